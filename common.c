@@ -22,64 +22,147 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 
 static struct gbm gbm;
 
+static struct gbm_bo * create_bo(struct gbm *gbm, int w, int h,
+		uint32_t format, const uint64_t *modifiers, int count)
+{
 #ifdef HAVE_GBM_MODIFIERS
-static int
-get_modifiers(uint64_t **mods)
+	if (count > 0)
+		return gbm_bo_create_with_modifiers(gbm->dev, w, h, format,
+				modifiers, count);
+#else
+	(void)modifiers;
+	(void)count;
+#endif
+	return gbm_bo_create(gbm->dev, w, h, format,
+			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+}
+
+static int create_ring(struct gbm *gbm, int w, int h, uint32_t format,
+		const uint64_t *modifiers, int count, unsigned int buffers)
 {
-	/* Assumed LINEAR is supported everywhere */
-	static uint64_t modifiers[] = {DRM_FORMAT_MOD_LINEAR};
-	*mods = modifiers;
-	return 1;
+	struct ring *ring;
+	unsigned int i;
+
+	if (buffers < 2 || buffers > MAX_RING_BUFFERS) {
+		printf("a buffer ring needs 2 to %u buffers\n", MAX_RING_BUFFERS);
+		return -1;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	for (i = 0; i < buffers; i++) {
+		ring->buffers[i].bo = create_bo(gbm, w, h, format, modifiers, count);
+		if (!ring->buffers[i].bo) {
+			printf("failed to create ring buffer %u\n", i);
+			while (i--)
+				gbm_bo_destroy(ring->buffers[i].bo);
+			free(ring);
+			return -1;
+		}
+	}
+
+	ring->num_buffers = buffers;
+	ring->current = -1;
+	gbm->ring = ring;
+
+	return 0;
 }
-#endif
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint64_t modifier)
+/* With no modifiers given, the driver picks one implicitly: */
+static int create_surface(struct gbm *gbm, int w, int h, uint32_t format,
+		const uint64_t *modifiers, int count, unsigned int buffers)
 {
-	gbm.dev = gbm_create_device(drm_fd);
+	if (buffers) {
+#ifndef HAVE_GBM_MODIFIERS
+		if (count > 0) {
+			fprintf(stderr, "Modifiers requested but support isn't available\n");
+			return -1;
+		}
+#endif
+		if (create_ring(gbm, w, h, format, modifiers, count, buffers))
+			return -1;
+		goto out;
+	}
 
 #ifndef HAVE_GBM_MODIFIERS
-	if (modifier != DRM_FORMAT_MOD_INVALID) {
+	(void)modifiers;
+	if (count > 0) {
 		fprintf(stderr, "Modifiers requested but support isn't available\n");
-		return NULL;
+		return -1;
 	}
-	gbm.surface = gbm_surface_create(gbm.dev, w, h,
-			GBM_FORMAT_XRGB8888,
+	gbm->surface = gbm_surface_create(gbm->dev, w, h,
+			format,
 			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
 #else
-	uint64_t *mods;
-	int count;
-	if (modifier != DRM_FORMAT_MOD_INVALID) {
-		count = 1;
-		mods = &modifier;
-	} else {
-		count = get_modifiers(&mods);
-	}
-	gbm.surface = gbm_surface_create_with_modifiers(gbm.dev, w, h,
-			GBM_FORMAT_XRGB8888, mods, count);
+	if (count > 0)
+		gbm->surface = gbm_surface_create_with_modifiers(gbm->dev, w, h,
+				format, modifiers, count);
+	else
+		gbm->surface = gbm_surface_create(gbm->dev, w, h,
+				format,
+				GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
 #endif
 
-	if (!gbm.surface) {
+	if (!gbm->surface) {
 		printf("failed to create gbm surface\n");
-		return NULL;
+		return -1;
 	}
 
-	gbm.width = w;
-	gbm.height = h;
+out:
+	gbm->format = format;
+	gbm->width = w;
+	gbm->height = h;
+
+	return 0;
+}
+
+const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
+		const uint64_t *modifiers, int count, unsigned int buffers)
+{
+	gbm.dev = gbm_create_device(drm_fd);
+
+	if (create_surface(&gbm, w, h, format, modifiers, count, buffers))
+		return NULL;
 
 	return &gbm;
 }
 
+/* Another surface (or ring) on the same device and in the same format,
+ * for driving an additional output:
+ */
+const struct gbm * init_gbm_output(const struct gbm *base, int w, int h,
+		const uint64_t *modifiers, int count)
+{
+	struct gbm *gbm = calloc(1, sizeof(*gbm));
+
+	gbm->dev = base->dev;
+
+	if (create_surface(gbm, w, h, base->format, modifiers, count,
+			base->ring ? base->ring->num_buffers : 0)) {
+		free(gbm);
+		return NULL;
+	}
+
+	return gbm;
+}
+
 static bool has_ext(const char *extension_list, const char *ext)
 {
 	const char *ptr = extension_list;
@@ -100,9 +183,269 @@ static bool has_ext(const char *extension_list, const char *ext)
 	}
 }
 
+/* eglChooseConfig() only sorts by channel sizes, which doesn't tell XRGB
+ * from ARGB (or the channel order), so pick the config whose native
+ * visual actually matches the gbm format:
+ */
+static int egl_choose_config(EGLDisplay display, const EGLint *attribs,
+		EGLint visual_id, EGLConfig *config)
+{
+	EGLConfig *configs;
+	EGLint count = 0, matched = 0, i;
+	int ret = -1;
+
+	if (!eglGetConfigs(display, NULL, 0, &count) || count < 1) {
+		printf("no EGL configs to choose from\n");
+		return -1;
+	}
+
+	configs = malloc(count * sizeof(*configs));
+	if (!configs)
+		return -1;
+
+	if (!eglChooseConfig(display, attribs, configs, count, &matched) || !matched) {
+		printf("no EGL configs with appropriate attributes\n");
+		goto out;
+	}
+
+	for (i = 0; i < matched; i++) {
+		EGLint id;
+
+		if (!eglGetConfigAttrib(display, configs[i], EGL_NATIVE_VISUAL_ID, &id))
+			continue;
+
+		if (id == visual_id) {
+			*config = configs[i];
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret)
+		printf("no EGL config matching gbm format %.4s\n", (char *)&visual_id);
+
+out:
+	free(configs);
+	return ret;
+}
+
+/* A window surface for a gbm surface, with the config of egl's context: */
+EGLSurface init_egl_surface(const struct egl *egl, const struct gbm *gbm)
+{
+	EGLSurface surface;
+
+	surface = eglCreateWindowSurface(egl->display, egl->config,
+			(EGLNativeWindowType)gbm->surface, NULL);
+	if (surface == EGL_NO_SURFACE)
+		printf("failed to create egl surface\n");
+
+	return surface;
+}
+
+/* Import each of the ring's bos as an EGLImage, and make it the color
+ * buffer of an fbo to render to:
+ */
+int init_egl_ring(const struct egl *egl, const struct gbm *gbm)
+{
+	static const EGLint plane_attrs[4][5] = {
+		{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+		  EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+	};
+	struct ring *ring = gbm->ring;
+	unsigned int i;
+
+	if (egl_check(egl, eglCreateImageKHR) ||
+	    egl_check(egl, glEGLImageTargetRenderbufferStorageOES))
+		return -1;
+
+	for (i = 0; i < ring->num_buffers; i++) {
+		struct ring_buffer *buf = &ring->buffers[i];
+		EGLint attr[7 + 4 * 10];
+		int fds[4] = { -1, -1, -1, -1 };
+		int planes = 1, n = 0, p;
+
+		attr[n++] = EGL_WIDTH;
+		attr[n++] = gbm_bo_get_width(buf->bo);
+		attr[n++] = EGL_HEIGHT;
+		attr[n++] = gbm_bo_get_height(buf->bo);
+		attr[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+		attr[n++] = gbm_bo_get_format(buf->bo);
+#ifdef HAVE_GBM_MODIFIERS
+		planes = gbm_bo_get_plane_count(buf->bo);
+		if (planes > 4)
+			planes = 4;
+#endif
+		/* each plane can be in a gem object of its own (aux planes of
+		 * compressed modifiers), so each gets its own fd:
+		 */
+		for (p = 0; p < planes; p++) {
+#if defined(HAVE_GBM_MODIFIERS) && defined(HAVE_GBM_BO_GET_FD_FOR_PLANE)
+			fds[p] = gbm_bo_get_fd_for_plane(buf->bo, p);
+#else
+			fds[p] = gbm_bo_get_fd(buf->bo);
+#endif
+			if (fds[p] < 0)
+				break;
+
+			attr[n++] = plane_attrs[p][0];
+			attr[n++] = fds[p];
+			attr[n++] = plane_attrs[p][1];
+#ifdef HAVE_GBM_MODIFIERS
+			attr[n++] = gbm_bo_get_offset(buf->bo, p);
+			attr[n++] = plane_attrs[p][2];
+			attr[n++] = gbm_bo_get_stride_for_plane(buf->bo, p);
+			if (gbm_bo_get_modifier(buf->bo) != DRM_FORMAT_MOD_INVALID) {
+				attr[n++] = plane_attrs[p][3];
+				attr[n++] = gbm_bo_get_modifier(buf->bo) & 0xffffffff;
+				attr[n++] = plane_attrs[p][4];
+				attr[n++] = gbm_bo_get_modifier(buf->bo) >> 32;
+			}
+#else
+			attr[n++] = 0;
+			attr[n++] = plane_attrs[p][2];
+			attr[n++] = gbm_bo_get_stride(buf->bo);
+#endif
+		}
+		attr[n++] = EGL_NONE;
+
+		buf->image = EGL_NO_IMAGE_KHR;
+		if (p == planes)
+			buf->image = egl->eglCreateImageKHR(egl->display,
+					EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attr);
+
+		/* the image holds its own references: */
+		for (p = 0; p < planes; p++)
+			if (fds[p] >= 0)
+				close(fds[p]);
+
+		if (buf->image == EGL_NO_IMAGE_KHR) {
+			printf("failed to import ring buffer %u\n", i);
+			return -1;
+		}
+
+		glGenRenderbuffers(1, &buf->rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, buf->rb);
+		egl->glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER,
+				buf->image);
+
+		glGenFramebuffers(1, &buf->fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, buf->fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_RENDERBUFFER, buf->rb);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+				GL_FRAMEBUFFER_COMPLETE) {
+			printf("can't render to ring buffer %u\n", i);
+			return -1;
+		}
+	}
+
+	printf("rendering to a ring of %u buffers\n", ring->num_buffers);
+
+	return bind_buffer(egl, gbm, EGL_NO_SURFACE);
+}
+
+int bind_buffer(const struct egl *egl, const struct gbm *gbm,
+		EGLSurface surface)
+{
+	struct ring *ring = gbm->ring;
+	unsigned int i;
+
+	if (!ring) {
+		if (eglGetCurrentSurface(EGL_DRAW) != surface)
+			eglMakeCurrent(egl->display, surface, surface, egl->context);
+		return 0;
+	}
+
+	/* the oldest free buffer, so they are used in turn: */
+	if (ring->current < 0) {
+		for (i = 0; i < ring->num_buffers; i++) {
+			unsigned int idx = (ring->next + i) % ring->num_buffers;
+
+			if (!ring->buffers[idx].busy) {
+				ring->current = idx;
+				break;
+			}
+		}
+		if (ring->current < 0)
+			return -1;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, ring->buffers[ring->current].fbo);
+
+	return 0;
+}
+
+struct gbm_bo * swap_buffers(const struct egl *egl, const struct gbm *gbm,
+		EGLSurface surface)
+{
+	struct ring *ring = gbm->ring;
+	struct ring_buffer *buf;
+
+	if (!ring) {
+		eglSwapBuffers(egl->display, surface);
+		return gbm_surface_lock_front_buffer(gbm->surface);
+	}
+
+	if (ring->current < 0)
+		return NULL;
+
+	/* submit the rendering, kms waits for it on the buffer's implicit
+	 * fence (or we on the out fence) before showing it:
+	 */
+	glFlush();
+
+	buf = &ring->buffers[ring->current];
+	buf->busy = 1;
+	ring->next = (ring->current + 1) % ring->num_buffers;
+	ring->current = -1;
+
+	return buf->bo;
+}
+
+void release_buffer(const struct gbm *gbm, struct gbm_bo *bo)
+{
+	unsigned int i;
+
+	if (!gbm->ring) {
+		gbm_surface_release_buffer(gbm->surface, bo);
+		return;
+	}
+
+	for (i = 0; i < gbm->ring->num_buffers; i++)
+		if (gbm->ring->buffers[i].bo == bo)
+			gbm->ring->buffers[i].busy = 0;
+}
+
+int has_free_buffers(const struct gbm *gbm)
+{
+	unsigned int i;
+
+	if (!gbm->ring)
+		return gbm_surface_has_free_buffers(gbm->surface);
+
+	if (gbm->ring->current >= 0)
+		return 1;
+
+	for (i = 0; i < gbm->ring->num_buffers; i++)
+		if (!gbm->ring->buffers[i].busy)
+			return 1;
+
+	return 0;
+}
+
 int init_egl(struct egl *egl, const struct gbm *gbm)
 {
-	EGLint major, minor, n;
+	EGLint major, minor;
 
 	static const EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -174,10 +517,9 @@ int init_egl(struct egl *egl, const struct gbm *gbm)
 		return -1;
 	}
 
-	if (!eglChooseConfig(egl->display, config_attribs, &egl->config, 1, &n) || n != 1) {
-		printf("failed to choose config: %d\n", n);
+	if (egl_choose_config(egl->display, config_attribs, gbm->format,
+			&egl->config))
 		return -1;
-	}
 
 	egl->context = eglCreateContext(egl->display, egl->config,
 			EGL_NO_CONTEXT, context_attribs);
@@ -186,11 +528,20 @@ int init_egl(struct egl *egl, const struct gbm *gbm)
 		return -1;
 	}
 
-	egl->surface = eglCreateWindowSurface(egl->display, egl->config,
-			(EGLNativeWindowType)gbm->surface, NULL);
-	if (egl->surface == EGL_NO_SURFACE) {
-		printf("failed to create egl surface\n");
-		return -1;
+	/* with a ring, the fbos are what we render to, there's nothing to
+	 * make a surface of:
+	 */
+	if (gbm->ring) {
+		if (!has_ext(egl_exts_dpy, "EGL_KHR_surfaceless_context")) {
+			printf("a buffer ring needs EGL_KHR_surfaceless_context\n");
+			return -1;
+		}
+		egl->surface = EGL_NO_SURFACE;
+	} else {
+		egl->surface = init_egl_surface(egl, gbm);
+		if (egl->surface == EGL_NO_SURFACE) {
+			return -1;
+		}
 	}
 
 	/* connect the context to the surface */
@@ -206,6 +557,10 @@ int init_egl(struct egl *egl, const struct gbm *gbm)
 	printf("===================================\n");
 
 	get_proc_gl(GL_OES_EGL_image, glEGLImageTargetTexture2DOES);
+	get_proc_gl(GL_OES_EGL_image, glEGLImageTargetRenderbufferStorageOES);
+
+	if (gbm->ring && init_egl_ring(egl, gbm))
+		return -1;
 
 	return 0;
 }
@@ -264,6 +619,21 @@ int create_program(const char *vs_src, const char *fs_src)
 	return program;
 }
 
+/* Height over width of what's being drawn to.  The backends set the
+ * viewport per output (and frame, with dynamic resolution), so scenes
+ * ask for it when drawing rather than going by the first gbm surface:
+ */
+GLfloat viewport_aspect(void)
+{
+	GLint viewport[4];
+
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	if (viewport[2] <= 0)
+		return 1.0f;
+
+	return (GLfloat)viewport[3] / (GLfloat)viewport[2];
+}
+
 int link_program(unsigned program)
 {
 	GLint ret;
@@ -288,3 +658,95 @@ int link_program(unsigned program)
 
 	return 0;
 }
+
+uint64_t get_time_ns(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return tv.tv_nsec + tv.tv_sec * 1000000000ull;
+}
+
+static uint64_t get_cpu_time_ns(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tv);
+	return tv.tv_nsec + tv.tv_sec * 1000000000ull;
+}
+
+void run_start(struct run *run, unsigned int max_frames, double duration)
+{
+	run->max_frames = max_frames;
+	run->max_ns = duration * 1000000000;
+	run->frames = 0;
+	run->start_ns = get_time_ns();
+	run->start_cpu_ns = get_cpu_time_ns();
+}
+
+/* Count a frame, returns 1 once the run is over: */
+int run_frame(struct run *run)
+{
+	run->frames++;
+
+	return (run->max_frames && run->frames >= run->max_frames) ||
+			run_expired(run);
+}
+
+/* Returns 1 once the run's duration is up, for when there are no frames
+ * to count it on (a static scene that stays on screen):
+ */
+int run_expired(const struct run *run)
+{
+	return run->max_ns && get_time_ns() - run->start_ns >= run->max_ns;
+}
+
+void run_report(const struct run *run, int json)
+{
+	double secs = (get_time_ns() - run->start_ns) / 1e9;
+	double cpu_ms = (get_cpu_time_ns() - run->start_cpu_ns) / 1e6;
+	double fps = secs > 0 ? run->frames / secs : 0;
+	double cpu_per_frame = run->frames ? cpu_ms / run->frames : 0;
+
+	if (json)
+		printf("{\"frames\": %u, \"wall_s\": %.3f, \"fps\": %.2f, "
+				"\"cpu_ms_per_frame\": %.3f}\n",
+				run->frames, secs, fps, cpu_per_frame);
+	else
+		printf("run: frames=%u wall_s=%.3f fps=%.2f cpu_ms_per_frame=%.3f\n",
+				run->frames, secs, fps, cpu_per_frame);
+}
+
+/* Render as fast as the gpu goes, without ever showing anything, so
+ * there's no display pacing.  Buffers go straight back to the surface.
+ */
+int benchmark_run(const struct gbm *gbm, const struct egl *egl,
+		struct run *run, int json)
+{
+	struct gbm_bo *bo;
+	int done = 0;
+
+	if (!run->max_frames && !run->max_ns) {
+		printf("benchmark needs a frame count or duration\n");
+		return -1;
+	}
+
+	while (!done) {
+		bind_buffer(egl, gbm, egl->surface);
+		egl->draw(ANIMATION_NS(run->frames));
+
+		bo = swap_buffers(egl, gbm, egl->surface);
+		if (!bo) {
+			printf("Failed to lock frontbuffer\n");
+			return -1;
+		}
+		release_buffer(gbm, bo);
+
+		done = run_frame(run);
+	}
+
+	/* count the frames the gpu still has queued up as well: */
+	glFinish();
+
+	run_report(run, json);
+
+	return 0;
+}
@@ -32,6 +32,8 @@
 #include <gbm.h>
 #include <drm_fourcc.h>
 
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
 #ifndef DRM_FORMAT_MOD_LINEAR
 #define DRM_FORMAT_MOD_LINEAR 0
 #endif
@@ -57,13 +59,56 @@ EGLAPI EGLSurface EGLAPIENTRY eglCreatePlatformPixmapSurfaceEXT (EGLDisplay dpy,
 #endif
 #endif /* EGL_EXT_platform_base */
 
+/* Instead of a gbm surface, a ring of scanout bos we allocate ourselves,
+ * each rendered to through an EGLImage backed fbo.  That way we decide
+ * how many buffers there are, and reuse them oldest first:
+ */
+#define MAX_RING_BUFFERS 8
+
+struct ring_buffer {
+	struct gbm_bo *bo;
+	EGLImageKHR image;
+	GLuint rb, fbo;
+	int busy;    /* swapped, and not released yet */
+};
+
+struct ring {
+	struct ring_buffer buffers[MAX_RING_BUFFERS];
+	unsigned int num_buffers;
+	unsigned int next;    /* where to look for a free buffer first */
+	int current;          /* bound for rendering, -1 if none */
+};
+
 struct gbm {
 	struct gbm_device *dev;
 	struct gbm_surface *surface;
+	struct ring *ring;    /* if set, there's no surface */
+	uint32_t format;
 	int width, height;
 };
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint64_t modifier);
+/* buffers is the size of the ring, 0 for a gbm surface: */
+const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
+		const uint64_t *modifiers, int count, unsigned int buffers);
+const struct gbm * init_gbm_output(const struct gbm *base, int w, int h,
+		const uint64_t *modifiers, int count);
+
+/* A layer of the scene that the display can scan out on a plane of its
+ * own underneath the egl surface (ie. video frames), instead of the gpu
+ * compositing it:
+ */
+struct underlay {
+	enum {
+		UNDERLAY_OFF,    /* gpu composites the layer */
+		UNDERLAY_PROBE,  /* gpu composites, but provide fb_id for testing */
+		UNDERLAY_ON,     /* layer is on its own plane, render with alpha */
+	} state;             /* set by the drm backend */
+
+	/* set by draw(), fb_id is 0 if there is no fb for this frame: */
+	uint32_t fb_id;
+	uint32_t format;
+	uint32_t width, height;
+};
 
 
 struct egl {
@@ -76,13 +121,22 @@ struct egl {
 	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
 	PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+	PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC glEGLImageTargetRenderbufferStorageOES;
 	PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
 	PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
 	PFNEGLWAITSYNCKHRPROC eglWaitSyncKHR;
 	PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
 	PFNEGLDUPNATIVEFENCEFDANDROIDPROC eglDupNativeFenceFDANDROID;
 
-	void (*draw)(unsigned i);
+	/* ns is when the frame is expected on screen, from the start: */
+	void (*draw)(uint64_t ns);
+	/* whether draw(ns) would change what's on screen since the last
+	 * draw, NULL if it always does:
+	 */
+	int (*dirty)(uint64_t ns);
+
+	/* only for scenes that have one: */
+	struct underlay *underlay;
 };
 
 static inline int __egl_check(void *ptr, const char *name)
@@ -97,7 +151,21 @@ static inline int __egl_check(void *ptr, const char *name)
 #define egl_check(egl, name) __egl_check((egl)->name, #name)
 
 int init_egl(struct egl *egl, const struct gbm *gbm);
+EGLSurface init_egl_surface(const struct egl *egl, const struct gbm *gbm);
+int init_egl_ring(const struct egl *egl, const struct gbm *gbm);
+
+/* Presenting through either a surface or a ring: bind where the next
+ * frame is drawn, then swap to finish it and get the bo it went to,
+ * which is locked until released:
+ */
+int bind_buffer(const struct egl *egl, const struct gbm *gbm,
+		EGLSurface surface);
+struct gbm_bo * swap_buffers(const struct egl *egl, const struct gbm *gbm,
+		EGLSurface surface);
+void release_buffer(const struct gbm *gbm, struct gbm_bo *bo);
+int has_free_buffers(const struct gbm *gbm);
 int create_program(const char *vs_src, const char *fs_src);
+GLfloat viewport_aspect(void);
 int link_program(unsigned program);
 
 enum mode {
@@ -116,6 +184,14 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode);
 struct decoder;
 struct decoder * video_init(const struct egl *egl, const struct gbm *gbm, const char *filename);
 EGLImage video_frame(struct decoder *dec);
+int video_frame_pending(struct decoder *dec);
+/* fb of the last frame, for scanning it out directly, 0 if it can't be.
+ * The fb stays valid for VIDEO_FB_HISTORY frames, enough to cover the
+ * ones in flight, the pending one and the one being scanned out:
+ */
+#define VIDEO_FB_HISTORY 8
+uint32_t video_frame_fb(struct decoder *dec, uint32_t *format,
+		uint32_t *width, uint32_t *height);
 void video_deinit(struct decoder *dec);
 
 const struct egl * init_cube_video(const struct gbm *gbm, const char *video);
@@ -130,6 +206,32 @@ init_cube_video(const struct gbm *gbm, const char *video)
 }
 #endif
 
+/* CLOCK_MONOTONIC, same as the kernel's vblank timestamps: */
+uint64_t get_time_ns(void);
+
+/* The scenes animate by a fixed step per frame of 60Hz, whatever rate
+ * the frames actually come at:
+ */
+#define ANIMATION_HZ 60
+#define ANIMATION_STEP(ns) ((ns) * (double)ANIMATION_HZ / 1000000000)
+#define ANIMATION_NS(steps) ((uint64_t)(steps) * 1000000000 / ANIMATION_HZ)
+
+/* A run bounded by frame count and/or duration (0 for no limit), and
+ * what it took, reported at the end:
+ */
+struct run {
+	unsigned int max_frames, frames;
+	uint64_t max_ns;
+	uint64_t start_ns, start_cpu_ns;
+};
+
+void run_start(struct run *run, unsigned int max_frames, double duration);
+int run_frame(struct run *run);
+int run_expired(const struct run *run);
+void run_report(const struct run *run, int json);
+int benchmark_run(const struct gbm *gbm, const struct egl *egl,
+		struct run *run, int json);
+
 #define DUMP_TARGET_WIDTH 1024
 #define DUMP_TARGET_HEIGHT 768
 int init_dump(const char *device);
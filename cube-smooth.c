@@ -31,12 +31,16 @@
 struct {
 	struct egl egl;
 
-	GLfloat aspect;
+	int flip_y;    /* rendering to a ring's fbos, row 0 is the top */
 
 	GLuint program;
 	GLint modelviewmatrix, modelviewprojectionmatrix, normalmatrix;
 	GLuint vbo;
 	GLuint positionsoffset, colorsoffset, normalsoffset;
+
+	/* what the last frame was drawn for: */
+	int drawn;
+	uint64_t last_ns;
 } gl;
 
 static const GLfloat vVertices[] = {
@@ -173,10 +177,19 @@ static const char *fragment_shader_source =
 		"}                                  \n";
 
 
-static void draw_cube_smooth(unsigned i)
+static int dirty_cube_smooth(uint64_t ns)
 {
+	return !gl.drawn || ns != gl.last_ns;
+}
+
+static void draw_cube_smooth(uint64_t ns)
+{
+	float i = ANIMATION_STEP(ns);
 	ESMatrix modelview;
 
+	gl.drawn = 1;
+	gl.last_ns = ns;
+
 	/* clear the color buffer */
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -188,8 +201,11 @@ static void draw_cube_smooth(unsigned i)
 	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
 
 	ESMatrix projection;
+	GLfloat aspect = viewport_aspect();
 	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.8f, +2.8f, -2.8f * gl.aspect, +2.8f * gl.aspect, 6.0f, 10.0f);
+	esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+	if (gl.flip_y)
+		esScale(&projection, 1.0f, -1.0f, 1.0f);
 
 	ESMatrix modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
@@ -226,7 +242,7 @@ const struct egl * init_cube_smooth(const struct gbm *gbm)
 	if (ret)
 		return NULL;
 
-	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	gl.flip_y = gbm->ring != NULL;
 
 	ret = create_program(vertex_shader_source, fragment_shader_source);
 	if (ret < 0)
@@ -250,6 +266,7 @@ const struct egl * init_cube_smooth(const struct gbm *gbm)
 
 	glViewport(0, 0, gbm->width, gbm->height);
 	glEnable(GL_CULL_FACE);
+	glFrontFace(gl.flip_y ? GL_CW : GL_CCW);
 
 	gl.positionsoffset = 0;
 	gl.colorsoffset = sizeof(vVertices);
@@ -268,6 +285,7 @@ const struct egl * init_cube_smooth(const struct gbm *gbm)
 	glEnableVertexAttribArray(2);
 
 	gl.egl.draw = draw_cube_smooth;
+	gl.egl.dirty = dirty_cube_smooth;
 
 	return &gl.egl;
 }
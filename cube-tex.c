@@ -33,7 +33,7 @@
 struct {
 	struct egl egl;
 
-	GLfloat aspect;
+	int flip_y;    /* rendering to a ring's fbos, row 0 is the top */
 	enum mode mode;
 	const struct gbm *gbm;
 
@@ -44,6 +44,10 @@ struct {
 	GLuint vbo;
 	GLuint positionsoffset, texcoordsoffset, normalsoffset;
 	GLuint tex[2];
+
+	/* what the last frame was drawn for: */
+	int drawn;
+	uint64_t last_ns;
 } gl;
 
 const struct egl *egl = &gl.egl;
@@ -448,10 +452,19 @@ static int init_tex(enum mode mode)
 	return -1;
 }
 
-static void draw_cube_tex(unsigned i)
+static int dirty_cube_tex(uint64_t ns)
 {
+	return !gl.drawn || ns != gl.last_ns;
+}
+
+static void draw_cube_tex(uint64_t ns)
+{
+	float i = ANIMATION_STEP(ns);
 	ESMatrix modelview;
 
+	gl.drawn = 1;
+	gl.last_ns = ns;
+
 	/* clear the color buffer */
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -463,8 +476,11 @@ static void draw_cube_tex(unsigned i)
 	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
 
 	ESMatrix projection;
+	GLfloat aspect = viewport_aspect();
 	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.8f, +2.8f, -2.8f * gl.aspect, +2.8f * gl.aspect, 6.0f, 10.0f);
+	esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+	if (gl.flip_y)
+		esScale(&projection, 1.0f, -1.0f, 1.0f);
 
 	ESMatrix modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
@@ -512,7 +528,7 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode)
 	    egl_check(&gl.egl, eglDestroyImageKHR))
 		return NULL;
 
-	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	gl.flip_y = gbm->ring != NULL;
 	gl.mode = mode;
 	gl.gbm = gbm;
 
@@ -544,6 +560,7 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode)
 
 	glViewport(0, 0, gbm->width, gbm->height);
 	glEnable(GL_CULL_FACE);
+	glFrontFace(gl.flip_y ? GL_CW : GL_CCW);
 
 	gl.positionsoffset = 0;
 	gl.texcoordsoffset = sizeof(vVertices);
@@ -569,6 +586,7 @@ const struct egl * init_cube_tex(const struct gbm *gbm, enum mode mode)
 	}
 
 	gl.egl.draw = draw_cube_tex;
+	gl.egl.dirty = dirty_cube_tex;
 
 	return &gl.egl;
 }
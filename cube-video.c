@@ -34,13 +34,13 @@
 struct {
 	struct egl egl;
 
-	GLfloat aspect;
+	int flip_y;    /* rendering to a ring's fbos, row 0 is the top */
 	const struct gbm *gbm;
 
 	GLuint program, blit_program;
 	/* uniform handles: */
 	GLint modelviewmatrix, modelviewprojectionmatrix, normalmatrix;
-	GLint texture, blit_texture;
+	GLint texture, blit_texture, blit_flip_y;
 	GLuint vbo;
 	GLuint positionsoffset, texcoordsoffset, normalsoffset;
 	GLuint tex;
@@ -50,7 +50,17 @@ struct {
 	int filenames_count, idx;
 	const char *filenames[32];
 
+	/* previous decoder, kept a few frames as its fbs may be on screen: */
+	struct decoder *retired_decoder;
+	int retired_frames;
+
+	struct underlay underlay;
+
 	EGLSyncKHR last_fence;
+
+	/* what the last frame was drawn for: */
+	int drawn;
+	uint64_t last_ns;
 } gl;
 
 static const struct egl *egl = &gl.egl;
@@ -157,12 +167,13 @@ static const GLfloat vNormals[] = {
 static const char *blit_vs =
 		"attribute vec4 in_position;        \n"
 		"attribute vec2 in_TexCoord;        \n"
+		"uniform float uFlipY;              \n"
 		"                                   \n"
 		"varying vec2 vTexCoord;            \n"
 		"                                   \n"
 		"void main()                        \n"
 		"{                                  \n"
-		"    gl_Position = in_position;     \n"
+		"    gl_Position = in_position * vec4(1.0, uFlipY, 1.0, 1.0);\n"
 		"    vTexCoord = in_TexCoord;       \n"
 		"}                                  \n";
 
@@ -220,27 +231,50 @@ static const char *fragment_shader_source =
 		"}                                  \n";
 
 
-static void draw_cube_video(unsigned i)
+/* a new video frame counts, as does the end of the video: */
+static int dirty_cube_video(uint64_t ns)
 {
+	return !gl.drawn || ns != gl.last_ns || video_frame_pending(gl.decoder);
+}
+
+static void draw_cube_video(uint64_t ns)
+{
+	float i = ANIMATION_STEP(ns);
 	ESMatrix modelview;
 	EGLImage frame;
 
+	gl.drawn = 1;
+	gl.last_ns = ns;
+
 	if (gl.last_fence) {
 		egl->eglClientWaitSyncKHR(egl->display, gl.last_fence, 0, EGL_FOREVER_KHR);
 		egl->eglDestroySyncKHR(egl->display, gl.last_fence);
 		gl.last_fence = NULL;
 	}
 
+	if (gl.retired_decoder && --gl.retired_frames == 0) {
+		video_deinit(gl.retired_decoder);
+		gl.retired_decoder = NULL;
+	}
+
 	frame = video_frame(gl.decoder);
 	if (!frame) {
 		/* end of stream */
 		glDeleteTextures(1, &gl.tex);
 		glGenTextures(1, &gl.tex);
-		video_deinit(gl.decoder);
+		if (gl.retired_decoder)
+			video_deinit(gl.retired_decoder);
+		gl.retired_decoder = gl.decoder;
+		gl.retired_frames = VIDEO_FB_HISTORY;
 		gl.idx = (gl.idx + 1) % gl.filenames_count;
 		gl.decoder = video_init(&gl.egl, gl.gbm, gl.filenames[gl.idx]);
 	}
 
+	gl.underlay.fb_id = 0;
+	if (frame && gl.underlay.state != UNDERLAY_OFF)
+		gl.underlay.fb_id = video_frame_fb(gl.decoder, &gl.underlay.format,
+				&gl.underlay.width, &gl.underlay.height);
+
 	glUseProgram(gl.blit_program);
 
 	glActiveTexture(GL_TEXTURE0);
@@ -251,13 +285,20 @@ static void draw_cube_video(unsigned i)
 	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frame);
 
-	/* clear the color buffer */
-	glClearColor(0.5, 0.5, 0.5, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	glUseProgram(gl.blit_program);
-	glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	if (gl.underlay.state == UNDERLAY_ON) {
+		/* the video is on a plane underneath, let it show through: */
+		glClearColor(0.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	} else {
+		/* clear the color buffer */
+		glClearColor(0.5, 0.5, 0.5, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		glUseProgram(gl.blit_program);
+		glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
+		glUniform1f(gl.blit_flip_y, gl.flip_y ? -1.0f : 1.0f);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
 
 	glUseProgram(gl.program);
 
@@ -268,8 +309,11 @@ static void draw_cube_video(unsigned i)
 	esRotate(&modelview, 10.0f + (0.15f * i), 0.0f, 0.0f, 1.0f);
 
 	ESMatrix projection;
+	GLfloat aspect = viewport_aspect();
 	esMatrixLoadIdentity(&projection);
-	esFrustum(&projection, -2.1f, +2.1f, -2.1f * gl.aspect, +2.1f * gl.aspect, 6.0f, 10.0f);
+	esFrustum(&projection, -2.1f, +2.1f, -2.1f * aspect, +2.1f * aspect, 6.0f, 10.0f);
+	if (gl.flip_y)
+		esScale(&projection, 1.0f, -1.0f, 1.0f);
 
 	ESMatrix modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
@@ -332,7 +376,7 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames)
 		return NULL;
 	}
 
-	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
+	gl.flip_y = gbm->ring != NULL;
 	gl.gbm = gbm;
 
 	ret = create_program(blit_vs, blit_fs);
@@ -349,6 +393,7 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames)
 		return NULL;
 
 	gl.blit_texture = glGetUniformLocation(gl.blit_program, "uTex");
+	gl.blit_flip_y = glGetUniformLocation(gl.blit_program, "uFlipY");
 
 	ret = create_program(vertex_shader_source, fragment_shader_source);
 	if (ret < 0)
@@ -371,6 +416,7 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames)
 
 	glViewport(0, 0, gbm->width, gbm->height);
 	glEnable(GL_CULL_FACE);
+	glFrontFace(gl.flip_y ? GL_CW : GL_CCW);
 
 	gl.positionsoffset = 0;
 	gl.texcoordsoffset = sizeof(vVertices);
@@ -392,6 +438,8 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames)
 	glGenTextures(1, &gl.tex);
 
 	gl.egl.draw = draw_cube_video;
+	gl.egl.dirty = dirty_cube_video;
+	gl.egl.underlay = &gl.underlay;
 
 	return &gl.egl;
 }
@@ -21,144 +21,492 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "drm-common.h"
 
-#define VOID2U64(x) ((uint64_t)(unsigned long)(x))
+static struct drm drm;
+
+struct prop_name {
+	const char *name;
+	bool optional;
+};
+
+static const struct prop_name plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_PROP_FB_ID]       = { "FB_ID" },
+	[PLANE_PROP_CRTC_ID]     = { "CRTC_ID" },
+	[PLANE_PROP_SRC_X]       = { "SRC_X" },
+	[PLANE_PROP_SRC_Y]       = { "SRC_Y" },
+	[PLANE_PROP_SRC_W]       = { "SRC_W" },
+	[PLANE_PROP_SRC_H]       = { "SRC_H" },
+	[PLANE_PROP_CRTC_X]      = { "CRTC_X" },
+	[PLANE_PROP_CRTC_Y]      = { "CRTC_Y" },
+	[PLANE_PROP_CRTC_W]      = { "CRTC_W" },
+	[PLANE_PROP_CRTC_H]      = { "CRTC_H" },
+	[PLANE_PROP_IN_FENCE_FD] = { "IN_FENCE_FD", .optional = true },
+	[PLANE_PROP_ZPOS]        = { "zpos", .optional = true },
+};
+
+static const struct prop_name crtc_prop_names[CRTC_PROP_COUNT] = {
+	[CRTC_PROP_MODE_ID]       = { "MODE_ID" },
+	[CRTC_PROP_ACTIVE]        = { "ACTIVE" },
+	[CRTC_PROP_VRR_ENABLED]   = { "VRR_ENABLED", .optional = true },
+};
 
-static struct drm drm = {
-	.kms_out_fence_fd = -1,
+static const struct prop_name connector_prop_names[CONNECTOR_PROP_COUNT] = {
+	[CONNECTOR_PROP_CRTC_ID] = { "CRTC_ID" },
+	[CONNECTOR_PROP_VRR_CAPABLE] = { "vrr_capable", .optional = true },
 };
 
-static int add_connector_property(drmModeAtomicReq *req, uint32_t obj_id,
-					const char *name, uint64_t value)
+/* Resolve the property ids we need into a table indexed by enum, failing
+ * if the driver doesn't expose one of them.  Optional properties that are
+ * missing are left as zero:
+ */
+static int find_prop_ids(uint32_t *prop_ids, const struct prop_name *names,
+		unsigned int count, const drmModeObjectProperties *props,
+		drmModePropertyRes **props_info, const char *type)
 {
-	struct connector *obj = drm.connector;
-	unsigned int i;
-	int prop_id = 0;
+	unsigned int i, j;
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
+	for (i = 0; i < count; i++) {
+		prop_ids[i] = 0;
+
+		for (j = 0; j < props->count_props; j++) {
+			if (strcmp(props_info[j]->name, names[i].name) == 0) {
+				prop_ids[i] = props_info[j]->prop_id;
+				break;
+			}
 		}
-	}
 
-	if (prop_id < 0) {
-		printf("no connector property: %s\n", name);
-		return -EINVAL;
+		if (!prop_ids[i] && !names[i].optional) {
+			printf("no %s property: %s\n", type, names[i].name);
+			return -EINVAL;
+		}
 	}
 
+	return 0;
+}
+
+/* Add a property to the request unless the kernel already has that value
+ * from an earlier commit.  Since atomic state persists between commits, in
+ * steady state this leaves just FB_ID (and the in-fence) in each request.
+ */
+static int add_property(drmModeAtomicReq *req, uint32_t obj_id,
+		uint32_t prop_id, uint64_t *prop_value, uint32_t *prop_valid,
+		unsigned int prop, uint64_t value)
+{
+	if ((*prop_valid & (1 << prop)) && (prop_value[prop] == value))
+		return 0;
+
+	prop_value[prop] = value;
+	*prop_valid |= 1 << prop;
+
 	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
 }
 
-static int add_crtc_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+static int add_connector_property(drmModeAtomicReq *req, struct output *output,
+					enum connector_prop prop, uint64_t value)
+{
+	struct connector *obj = output->connector;
+
+	return add_property(req, output->connector_id, obj->prop_id[prop],
+			obj->prop_value, &obj->prop_valid, prop, value);
+}
+
+static int add_crtc_property(drmModeAtomicReq *req, struct output *output,
+				enum crtc_prop prop, uint64_t value)
+{
+	struct crtc *obj = output->crtc;
+
+	return add_property(req, output->crtc_id, obj->prop_id[prop],
+			obj->prop_value, &obj->prop_valid, prop, value);
+}
+
+static int add_plane_property(drmModeAtomicReq *req, struct plane *obj,
+				enum plane_prop prop, uint64_t value)
+{
+	return add_property(req, obj->plane->plane_id, obj->prop_id[prop],
+			obj->prop_value, &obj->prop_valid, prop, value);
+}
+
+/* Something to put on screen, scaled to cover it.  Layers are ordered
+ * bottom to top, the last one being the egl surface:
+ */
+struct layer {
+	uint32_t fb_id;
+	uint32_t format;
+	uint32_t width, height;
+	int optional;         /* can be composited by the gpu instead */
+};
+
+#define MAX_LAYERS 2
+
+/* Which plane each layer goes on (NULL if left to the gpu), and at what
+ * zpos.  Validated configs are cached by the layers' format and size:
+ */
+struct plane_config {
+	unsigned int count;
+	struct layer layers[MAX_LAYERS];
+	struct plane *planes[MAX_LAYERS];
+	uint64_t zpos[MAX_LAYERS];
+};
+
+#define MAX_CACHED_CONFIGS 8
+#define MAX_TEST_COMMITS 8
+
+static void add_layer(drmModeAtomicReq *req, struct output *output,
+		struct plane *plane, const struct layer *layer, uint64_t zpos)
+{
+	if (plane->has_zpos && plane->zpos_min != plane->zpos_max)
+		add_plane_property(req, plane, PLANE_PROP_ZPOS, zpos);
+
+	add_plane_property(req, plane, PLANE_PROP_FB_ID, layer->fb_id);
+	add_plane_property(req, plane, PLANE_PROP_CRTC_ID, output->crtc_id);
+	add_plane_property(req, plane, PLANE_PROP_SRC_X, 0);
+	add_plane_property(req, plane, PLANE_PROP_SRC_Y, 0);
+	add_plane_property(req, plane, PLANE_PROP_SRC_W, layer->width << 16);
+	add_plane_property(req, plane, PLANE_PROP_SRC_H, layer->height << 16);
+	add_plane_property(req, plane, PLANE_PROP_CRTC_X, 0);
+	add_plane_property(req, plane, PLANE_PROP_CRTC_Y, 0);
+	add_plane_property(req, plane, PLANE_PROP_CRTC_W, output->mode->hdisplay);
+	add_plane_property(req, plane, PLANE_PROP_CRTC_H, output->mode->vdisplay);
+}
+
+static void invalidate_state(struct output *output)
 {
-	struct crtc *obj = drm.crtc;
 	unsigned int i;
-	int prop_id = -1;
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
+	for (i = 0; i < output->num_planes; i++)
+		output->planes[i]->prop_valid = 0;
+	output->crtc->prop_valid = 0;
+	output->connector->prop_valid = 0;
+}
+
+/* Commit the layers as placed by config, with any of the output's planes
+ * that config doesn't use turned off.  The in-fence goes with the top
+ * layer.  Each output is committed on its own, so they flip (and can
+ * fall behind) independently.
+ */
+static int drm_atomic_commit(struct output *output,
+		const struct plane_config *config, const struct layer *layers,
+		int in_fence_fd, uint32_t flags, void *data)
+{
+	drmModeAtomicReq *req = drm.req;
+	struct plane *top = config->planes[config->count - 1];
+	unsigned int i, j;
+	int ret;
+
+	/* reuse the request buffer from the previous commit: */
+	drmModeAtomicSetCursor(req, 0);
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+		if (add_connector_property(req, output, CONNECTOR_PROP_CRTC_ID,
+						output->crtc_id) < 0)
+				return -1;
+
+		if (add_crtc_property(req, output, CRTC_PROP_MODE_ID,
+				output->mode_blob_id) < 0)
+			return -1;
+
+		if (add_crtc_property(req, output, CRTC_PROP_ACTIVE, 1) < 0)
+			return -1;
+	}
+
+	/* drivers take this without a modeset, so it goes in with the first
+	 * commit even when we took over the current mode:
+	 */
+	if (output->crtc->prop_id[CRTC_PROP_VRR_ENABLED] &&
+	    add_crtc_property(req, output, CRTC_PROP_VRR_ENABLED,
+			output->vrr) < 0)
+		return -1;
+
+	for (i = 0; i < output->num_planes; i++) {
+		struct plane *plane = output->planes[i];
+
+		for (j = 0; j < config->count; j++)
+			if (config->planes[j] == plane)
+				break;
+
+		if (j < config->count) {
+			add_layer(req, output, plane, &layers[j], config->zpos[j]);
+		} else {
+			add_plane_property(req, plane, PLANE_PROP_FB_ID, 0);
+			add_plane_property(req, plane, PLANE_PROP_CRTC_ID, 0);
 		}
 	}
 
-	if (prop_id < 0) {
-		printf("no crtc property: %s\n", name);
-		return -EINVAL;
+	/* The in-fence is one-shot, and fd numbers get recycled, so it
+	 * bypasses the delta tracking and goes in every request:
+	 */
+	if (in_fence_fd != -1) {
+		drmModeAtomicAddProperty(req, top->plane->plane_id,
+				top->prop_id[PLANE_PROP_IN_FENCE_FD],
+				in_fence_fd);
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	ret = drmModeAtomicCommit(drm.fd, req, flags, data);
+
+	/* If it failed we don't know what the kernel has now, and a test
+	 * commit didn't change anything, either way resend everything:
+	 */
+	if (ret || (flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		invalidate_state(output);
+
+	return ret;
+}
+
+static int plane_has_format(const struct plane *plane, uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < plane->plane->count_formats; i++)
+		if (plane->plane->formats[i] == format)
+			return 1;
+
+	return 0;
 }
 
-static int add_plane_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+static int test_config(struct output *output, struct plane_config *config,
+		uint32_t flags)
 {
-	struct plane *obj = drm.plane;
 	unsigned int i;
-	int prop_id = -1;
+	int ret;
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
-		}
-	}
+	ret = drm_atomic_commit(output, config, config->layers, -1,
+			DRM_MODE_ATOMIC_TEST_ONLY |
+			(flags & DRM_MODE_ATOMIC_ALLOW_MODESET), NULL);
+	if (ret)
+		return ret;
 
+	for (i = 0; i < config->count; i++) {
+		const struct layer *layer = &config->layers[i];
 
-	if (prop_id < 0) {
-		printf("no plane property: %s\n", name);
-		return -EINVAL;
+		if (config->planes[i] &&
+		    (layer->width != output->mode->hdisplay ||
+		     layer->height != output->mode->vdisplay))
+			config->planes[i]->can_scale = 1;
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	return 0;
 }
 
-static int drm_atomic_commit(uint32_t fb_id, uint32_t flags)
+/* Place layers idx and up on planes, trying candidates until a test
+ * commit of the whole config passes.  Layers are stacked by zpos, so with
+ * more than one layer on screen only planes with a zpos can be used.  The
+ * egl surface prefers the primary plane, anything under it an overlay.
+ */
+static int assign_layers(struct output *output, struct plane_config *config,
+		unsigned int idx, unsigned int stacked, unsigned int *tests,
+		uint32_t flags)
 {
-	drmModeAtomicReq *req;
-	uint32_t plane_id = drm.plane->plane->plane_id;
-	uint32_t blob_id;
-	int ret;
+	const struct layer *layer = &config->layers[idx];
+	int top = (idx == config->count - 1);
+	uint64_t below = 0;
+	int have_below = 0;
+	unsigned int pass, i, j;
+
+	if (idx == config->count) {
+		if (*tests >= MAX_TEST_COMMITS)
+			return -1;
+		(*tests)++;
+		return test_config(output, config, flags);
+	}
 
-	req = drmModeAtomicAlloc();
+	/* layer dropped, the gpu composites it: */
+	if (!layer->fb_id) {
+		config->planes[idx] = NULL;
+		return assign_layers(output, config, idx + 1, stacked, tests, flags);
+	}
 
-	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
-		if (add_connector_property(req, drm.connector_id, "CRTC_ID",
-						drm.crtc_id) < 0)
+	for (j = 0; j < idx; j++) {
+		if (config->planes[j]) {
+			below = config->zpos[j];
+			have_below = 1;
+		}
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < output->num_planes; i++) {
+			struct plane *plane = output->planes[i];
+			int primary = (plane->type == DRM_PLANE_TYPE_PRIMARY);
+			uint64_t zpos = plane->zpos_min;
+
+			if (plane->type == DRM_PLANE_TYPE_CURSOR)
+				continue;
+			if ((primary == top) != (pass == 0))
+				continue;
+			if (!plane_has_format(plane, layer->format))
+				continue;
+
+			for (j = 0; j < idx; j++)
+				if (config->planes[j] == plane)
+					break;
+			if (j < idx)
+				continue;
+
+			if (stacked > 1) {
+				if (!plane->has_zpos)
+					continue;
+				if (have_below && zpos <= below)
+					zpos = below + 1;
+				if (zpos > plane->zpos_max)
+					continue;
+			}
+
+			config->planes[idx] = plane;
+			config->zpos[idx] = zpos;
+
+			if (!assign_layers(output, config, idx + 1, stacked, tests, flags))
+				return 0;
+			if (*tests >= MAX_TEST_COMMITS)
 				return -1;
+		}
+	}
 
-		if (drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
-					      &blob_id) != 0)
-			return -1;
+	config->planes[idx] = NULL;
+	return -1;
+}
 
-		if (add_crtc_property(req, drm.crtc_id, "MODE_ID", blob_id) < 0)
-			return -1;
+static int same_layers(const struct plane_config *config,
+		const struct layer *layers, unsigned int count)
+{
+	unsigned int i;
 
-		if (add_crtc_property(req, drm.crtc_id, "ACTIVE", 1) < 0)
-			return -1;
+	if (config->count != count)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		const struct layer *a = &config->layers[i], *b = &layers[i];
+
+		if (a->format != b->format || a->width != b->width ||
+		    a->height != b->height || a->optional != b->optional)
+			return 0;
 	}
 
-	add_plane_property(req, plane_id, "FB_ID", fb_id);
-	add_plane_property(req, plane_id, "CRTC_ID", drm.crtc_id);
-	add_plane_property(req, plane_id, "SRC_X", 0);
-	add_plane_property(req, plane_id, "SRC_Y", 0);
-	add_plane_property(req, plane_id, "SRC_W", drm.mode->hdisplay << 16);
-	add_plane_property(req, plane_id, "SRC_H", drm.mode->vdisplay << 16);
-	add_plane_property(req, plane_id, "CRTC_X", 0);
-	add_plane_property(req, plane_id, "CRTC_Y", 0);
-	add_plane_property(req, plane_id, "CRTC_W", drm.mode->hdisplay);
-	add_plane_property(req, plane_id, "CRTC_H", drm.mode->vdisplay);
+	return 1;
+}
 
-	if (drm.kms_in_fence_fd != -1) {
-		add_crtc_property(req, drm.crtc_id, "OUT_FENCE_PTR",
-				VOID2U64(&drm.kms_out_fence_fd));
-		add_plane_property(req, plane_id, "IN_FENCE_FD", drm.kms_in_fence_fd);
+/* A rendered frame on its way to the screen: */
+struct frame {
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+	int gpu_fence_fd;   /* out-fence from gpu, -1 once rendering is done */
+	uint64_t start_ns;  /* when we started rendering it */
+	unsigned int target_seq; /* vblank it is meant for */
+	uint64_t present_ns;     /* ..and when we expect that to be */
+	uint64_t render_ns;      /* start to gpu done, 0 if not seen */
+	int width, height;       /* the part of the buffer rendered to */
+	struct underlay video;   /* the scene's underlay when it was drawn */
+
+	/* filled in by the flip event: */
+	int flipped;
+	unsigned int flip_seq;
+	uint64_t flip_ns;
+};
+
+/* Per output, where it renders to and the frames on their way to it.
+ * Frames move from the queue (rendered, waiting for the previous commit
+ * to complete), to pending (committed, flip not yet done), to scanout.
+ */
+struct screen {
+	struct output *output;
+	const struct gbm *gbm;
+	EGLSurface surface;
+	uint32_t flags;
+	int hold;    /* waiting for the vblank before the next flip is due */
+	int dirty;   /* the scene changed since this output last drew it */
+	int first;   /* the first frame isn't on screen yet */
+	uint64_t idle_until;  /* when to check again if it did */
+
+	struct frame queue[MAX_FRAMES_IN_FLIGHT];
+	unsigned int head, count;
+	struct frame pending, scanout;
+
+	struct plane_config configs[MAX_CACHED_CONFIGS];
+	unsigned int num_configs, next_config;
+};
+
+static struct screen screens[MAX_OUTPUTS];
+
+/* Find planes for the layers, leaving the optional ones that don't fit
+ * to the gpu.  Returns NULL if even the required layers can't be shown.
+ */
+static const struct plane_config * get_config(struct screen *screen,
+		const struct layer *layers, unsigned int count, uint32_t flags)
+{
+	struct plane_config *config;
+	unsigned int tests = 0, stacked = 0, i;
+
+	for (i = 0; i < screen->num_configs; i++)
+		if (same_layers(&screen->configs[i], layers, count))
+			return &screen->configs[i];
+
+	config = &screen->configs[screen->next_config];
+	screen->next_config = (screen->next_config + 1) % MAX_CACHED_CONFIGS;
+	if (screen->num_configs < MAX_CACHED_CONFIGS)
+		screen->num_configs++;
+
+	config->count = count;
+	for (i = 0; i < count; i++) {
+		config->layers[i] = layers[i];
+		if (layers[i].fb_id)
+			stacked++;
 	}
 
-	ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
-	if (ret)
+	if (!assign_layers(screen->output, config, 0, stacked, &tests, flags))
 		goto out;
 
-	if (drm.kms_in_fence_fd != -1) {
-		close(drm.kms_in_fence_fd);
-		drm.kms_in_fence_fd = -1;
+	/* fall back to the gpu for the optional layers: */
+	tests = 0;
+	stacked = 0;
+	for (i = 0; i < count; i++) {
+		if (config->layers[i].optional)
+			config->layers[i].fb_id = 0;
+		if (config->layers[i].fb_id)
+			stacked++;
 	}
 
+	if (!assign_layers(screen->output, config, 0, stacked, &tests, flags))
+		goto out;
+
+	printf("no plane configuration works for the egl surface%s\n",
+			(layers[count - 1].width != screen->output->mode->hdisplay ||
+			 layers[count - 1].height != screen->output->mode->vdisplay) ?
+			" (it needs a plane that can scale)" : "");
+	config->count = 0;
+	return NULL;
+
 out:
-	drmModeAtomicFree(req);
+	/* the layers as asked for are the cache key: */
+	for (i = 0; i < count; i++)
+		config->layers[i] = layers[i];
+
+	for (i = 0; i < count; i++) {
+		if (config->planes[i])
+			printf("layer %u: %.4s %ux%u on plane %u, zpos %"PRIu64"\n", i,
+					(char *)&layers[i].format, layers[i].width,
+					layers[i].height, config->planes[i]->plane->plane_id,
+					config->zpos[i]);
+		else
+			printf("layer %u: %.4s %ux%u composited by the gpu\n", i,
+					(char *)&layers[i].format, layers[i].width,
+					layers[i].height);
+	}
 
-	return ret;
+	return config;
 }
 
 static EGLSyncKHR create_fence(const struct egl *egl, int fd)
@@ -173,234 +521,969 @@ static EGLSyncKHR create_fence(const struct egl *egl, int fd)
 	return fence;
 }
 
-static int atomic_run(const struct gbm *gbm, const struct egl *egl)
+static void page_flip_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
 {
-	struct gbm_bo *bo = NULL;
-	struct drm_fb *fb;
-	uint32_t i = 0;
-	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+	/* suppress 'unused parameter' warnings */
+	(void)fd;
+
+	struct frame *f = data;
+
+	f->flipped = 1;
+	f->flip_seq = frame;
+	f->flip_ns = (uint64_t)sec * 1000000000 + (uint64_t)usec * 1000;
+}
+
+static void vblank_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
+{
+	/* suppress 'unused parameter' warnings */
+	(void)fd;
+	(void)frame;
+	(void)sec;
+	(void)usec;
+
+	struct screen *screen = data;
+	screen->hold = 0;
+}
+
+/* when the scenes' animation starts: */
+static uint64_t animation_start_ns;
+
+/* The scene is shared by all outputs, so when it changes, it has changed
+ * for all of them, whichever draws it first:
+ */
+static int scene_dirty(struct screen *screen, const struct egl *egl,
+		uint64_t ns)
+{
+	unsigned int i;
+
+	if (!egl->dirty)
+		return 1;
+
+	if (egl->dirty(ns))
+		for (i = 0; i < drm.num_outputs; i++)
+			screens[i].dirty = 1;
+
+	return screen->dirty;
+}
+
+/* Returns 1 if the scene is static and there was nothing to render: */
+static int render_frame(struct screen *screen, const struct egl *egl,
+		struct frame *frame, unsigned int target_seq)
+{
+	const struct gbm *gbm = screen->gbm;
+	const struct output *output = screen->output;
+	EGLSyncKHR gpu_fence;
+
+	frame->start_ns = get_time_ns();
+
+	/* animate for when the frame will be on screen, so it moves
+	 * smoothly even when frames get missed or dropped.  With vrr or
+	 * async flips that is as soon as it's done:
+	 */
+	frame->target_seq = target_seq;
+	if (output->vrr || drm.opts.async_flip)
+		frame->present_ns = frame->start_ns + output->pacing.render_ns;
+	else
+		frame->present_ns = pacing_vblank_ns(&output->pacing, target_seq,
+				frame->start_ns);
+	if (frame->present_ns < animation_start_ns)
+		frame->present_ns = animation_start_ns;
+
+	/* with a static scene, nothing to do unless something changed, in
+	 * which case the last frame just stays on screen:
+	 */
+	if (drm.opts.static_scene) {
+		if (!scene_dirty(screen, egl, 0)) {
+			screen->idle_until = frame->start_ns + output->pacing.period_ns;
+			return 1;
+		}
+		screen->dirty = 0;
+	}
+
+	/* all outputs share the context, point it at this one's surface
+	 * (or next buffer):
+	 */
+	bind_buffer(egl, gbm, screen->surface);
+
+	/* With dynamic resolution, render to the top left of the buffer
+	 * only, which is the bottom of a window surface in gl terms but
+	 * the start of a ring's fbo.  The scissor keeps the clear in there
+	 * as well:
+	 */
+	dynres_size(&output->dynres, gbm->width, gbm->height,
+			&frame->width, &frame->height);
+	if (drm.num_outputs > 1 || drm.opts.dynamic_res) {
+		int y = gbm->ring ? 0 : gbm->height - frame->height;
+
+		glViewport(0, y, frame->width, frame->height);
+		glScissor(0, y, frame->width, frame->height);
+	}
+	frame->render_ns = 0;
+
+	/* a static scene stays frozen at the start, present_ns is still
+	 * when the frame is due, for dropping it if it's late:
+	 */
+	egl->draw(drm.opts.static_scene ? 0 :
+			frame->present_ns - animation_start_ns);
+
+	/* insert fence to be singled in cmdstream.. this fence will be
+	 * signaled when gpu rendering done
+	 */
+	gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
+	assert(gpu_fence);
+
+	frame->bo = swap_buffers(egl, gbm, screen->surface);
+
+	/* after swapbuffers, gpu_fence should be flushed, so safe
+	 * to get fd:
+	 */
+	frame->gpu_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
+	egl->eglDestroySyncKHR(egl->display, gpu_fence);
+	assert(frame->gpu_fence_fd != -1);
+
+	if (!frame->bo) {
+		printf("Failed to lock frontbuffer\n");
+		return -1;
+	}
+	frame->fb = drm_fb_get_from_bo(frame->bo);
+	if (!frame->fb) {
+		printf("Failed to get a new framebuffer BO\n");
+		return -1;
+	}
+
+	frame->flipped = 0;
+
+	if (egl->underlay)
+		frame->video = *egl->underlay;
+	else
+		frame->video.state = UNDERLAY_OFF;
+
+	return 0;
+}
+
+/* The frame's layers, bottom to top, returning how many there are: */
+static unsigned int frame_layers(const struct frame *frame, struct layer *layers)
+{
+	unsigned int count = 0;
+
+	if (frame->video.state != UNDERLAY_OFF && frame->video.fb_id) {
+		layers[count++] = (struct layer){
+			.fb_id = frame->video.fb_id,
+			.format = frame->video.format,
+			.width = frame->video.width,
+			.height = frame->video.height,
+			.optional = 1,
+		};
+	}
+
+	layers[count++] = (struct layer){
+		.fb_id = frame->fb->fb_id,
+		.format = gbm_bo_get_format(frame->bo),
+		.width = frame->width,
+		.height = frame->height,
+	};
+
+	return count;
+}
+
+/* When the next frame can be started, or UINT64_MAX if there is nothing
+ * to render into yet.  With --render-late, frames are rendered one at a
+ * time, each started just in time for the vblank after the pending one.
+ */
+static uint64_t frame_start(const struct screen *screen,
+		unsigned int *target_seq)
+{
+	const struct pacing *pacing = &screen->output->pacing;
+	uint64_t now = get_time_ns();
+
+	*target_seq = 0;
+
+	if (screen->count >= drm.opts.frames_in_flight ||
+	    !has_free_buffers(screen->gbm))
+		return UINT64_MAX;
+
+	/* with adaptive sync the flip follows the frame, no need to wait,
+	 * the frame goes on the first vblank after the frames before it
+	 * that it can still make:
+	 */
+	if (!drm.opts.render_late || screen->output->vrr) {
+		unsigned int interval = screen->output->interval;
+		unsigned int target;
+
+		if (screen->count)
+			target = screen->queue[(screen->head + screen->count - 1) %
+					MAX_FRAMES_IN_FLIGHT].target_seq;
+		else if (screen->pending.bo)
+			target = screen->pending.target_seq;
+		else
+			target = pacing->vblank_seq;
+
+		target += interval;
+		while (pacing->vblank_ns &&
+		       pacing_vblank_ns(pacing, target, now) < now + pacing->render_ns)
+			target += interval;
+
+		*target_seq = target;
+		return now;
+	}
+
+	if (screen->count > 0)
+		return UINT64_MAX;
+
+	return pacing_next_start(pacing, now,
+			(screen->pending.bo ? screen->pending.target_seq : pacing->vblank_seq) +
+			screen->output->interval - 1, target_seq);
+}
+
+static uint64_t render_start(const struct screen *screen,
+		unsigned int *target_seq)
+{
+	uint64_t start = frame_start(screen, target_seq);
+
+	/* the scene was static last time we looked, look again later: */
+	if (start != UINT64_MAX && start < screen->idle_until)
+		start = screen->idle_until;
+
+	return start;
+}
+
+/* Drop queued frames that are too late for the vblank they were meant
+ * for, when there is a newer frame ready to go instead.  Otherwise one
+ * late frame would push back all the ones queued behind it.
+ */
+static void drop_late_frames(struct screen *screen, int has_in_fence)
+{
+	struct output *output = screen->output;
+	uint64_t now = get_time_ns();
+
+	if (output->vrr || drm.opts.async_flip)
+		return;
+
+	while (screen->count > 1) {
+		struct frame *late = &screen->queue[screen->head];
+		const struct frame *next =
+				&screen->queue[(screen->head + 1) % MAX_FRAMES_IN_FLIGHT];
+
+		if (late->present_ns >= now ||
+		    !(has_in_fence || next->gpu_fence_fd == -1))
+			break;
+
+		if (late->gpu_fence_fd != -1) {
+			close(late->gpu_fence_fd);
+			late->gpu_fence_fd = -1;
+		}
+		release_buffer(screen->gbm, late->bo);
+		late->bo = NULL;
+		stats_drop(&output->stats);
+
+		screen->head = (screen->head + 1) % MAX_FRAMES_IN_FLIGHT;
+		screen->count--;
+	}
+}
+
+/* atomic will reject a commit while the previous one is still pending,
+ * so queued frames wait their turn:
+ */
+static int can_commit(const struct screen *screen, int has_in_fence)
+{
+	const struct frame *next = &screen->queue[screen->head];
+
+	return !screen->pending.bo && screen->count && !screen->hold &&
+			(has_in_fence || next->gpu_fence_fd == -1);
+}
+
+/* The first commit on an output whose mode we took over goes without
+ * a modeset, if the kernel won't take it like that, do one after all:
+ */
+static int fall_back_to_modeset(struct screen *screen)
+{
+	if (!screen->first || (screen->flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+		return 0;
+
+	printf("connector %u: can't take over the current mode, doing a modeset\n",
+			screen->output->connector_id);
+	screen->output->adopted = 0;
+	screen->flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	return 1;
+}
+
+static int commit_next(struct screen *screen, const struct egl *egl)
+{
+	struct frame *pending = &screen->pending;
+	struct layer layers[MAX_LAYERS];
+	const struct plane_config *config;
+	unsigned int nlayers;
 	int ret;
 
-	if (egl_check(egl, eglDupNativeFenceFDANDROID) ||
-	    egl_check(egl, eglCreateSyncKHR) ||
-	    egl_check(egl, eglDestroySyncKHR) ||
-	    egl_check(egl, eglWaitSyncKHR) ||
-	    egl_check(egl, eglClientWaitSyncKHR))
+	*pending = screen->queue[screen->head];
+	screen->head = (screen->head + 1) % MAX_FRAMES_IN_FLIGHT;
+	screen->count--;
+
+	nlayers = frame_layers(pending, layers);
+	config = get_config(screen, layers, nlayers, screen->flags);
+	if (!config && fall_back_to_modeset(screen))
+		config = get_config(screen, layers, nlayers, screen->flags);
+	if (!config)
 		return -1;
 
-	/* Allow a modeset change for the first commit only. */
-	flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	/* frames drawn from now on know if the video is on a plane: */
+	if (nlayers > 1 && egl->underlay->state != UNDERLAY_OFF)
+		egl->underlay->state = config->planes[0] ?
+				UNDERLAY_ON : UNDERLAY_OFF;
 
-	while (1) {
-		struct gbm_bo *next_bo;
-		EGLSyncKHR gpu_fence = NULL;   /* out-fence from gpu, in-fence to kms */
-		EGLSyncKHR kms_fence = NULL;   /* in-fence to gpu, out-fence from kms */
+	ret = drm_atomic_commit(screen->output, config, layers,
+			pending->gpu_fence_fd, screen->flags, pending);
+	if (ret && fall_back_to_modeset(screen))
+		ret = drm_atomic_commit(screen->output, config, layers,
+				pending->gpu_fence_fd, screen->flags, pending);
+	if (ret) {
+		printf("failed to commit: %s\n", strerror(errno));
+		return -1;
+	}
 
-		if (drm.kms_out_fence_fd != -1) {
-			kms_fence = create_fence(egl, drm.kms_out_fence_fd);
-			assert(kms_fence);
+	/* Allow a modeset change for the first commit only, async flips
+	 * can't do anything but switch fbs, so only from then on:
+	 */
+	screen->flags &= ~(DRM_MODE_ATOMIC_ALLOW_MODESET);
+	if (drm.opts.async_flip)
+		screen->flags |= DRM_MODE_PAGE_FLIP_ASYNC;
 
-			/* driver now has ownership of the fence fd: */
-			drm.kms_out_fence_fd = -1;
+	return 0;
+}
 
-			/* wait "on the gpu" (ie. this won't necessarily block, but
-			 * will block the rendering until fence is signaled), until
-			 * the previous pageflip completes so we don't render into
-			 * the buffer that is still on screen.
-			 */
-			egl->eglWaitSyncKHR(egl->display, kms_fence, 0);
+static void dynres_report(const struct screen *screen)
+{
+	const struct output *output = screen->output;
+	const struct dynres *dynres = &output->dynres;
+	double budget_ms = output->pacing.period_ns * output->interval / 1e6;
+	int w, h;
+
+	dynres_size(dynres, screen->gbm->width, screen->gbm->height, &w, &h);
+	if (drm.opts.stats_json)
+		printf("{\"connector\": %u, \"render_scale\": %.2f, \"width\": %d, "
+				"\"height\": %d, \"render_ms\": %.3f, \"budget_ms\": %.3f}\n",
+				output->connector_id, dynres->scale, w, h,
+				dynres->render_ns / 1e6, budget_ms);
+	else
+		printf("connector %u: render scale %.2f (%dx%d), render %.2f ms of %.2f ms\n",
+				output->connector_id, dynres->scale, w, h,
+				dynres->render_ns / 1e6, budget_ms);
+}
+
+static void flip_done(struct screen *screen)
+{
+	struct output *output = screen->output;
+	struct frame *pending = &screen->pending;
+
+	/* with adaptive sync or async flips, vblanks don't pace the frames: */
+	if (stats_flip(&output->stats, pending->flip_seq, pending->flip_ns,
+			(output->vrr || drm.opts.async_flip) ? 0 : output->interval))
+		stats_report(&output->stats, output, 0, drm.opts.stats_json);
+
+	if (screen->first) {
+		report_first_flip(&drm, output, pending->flip_ns);
+		screen->first = 0;
+	}
+
+	/* the render time against the frame budget decides the size of
+	 * the frames to come:
+	 */
+	if (drm.opts.dynamic_res && pending->render_ns &&
+	    dynres_frame(&output->dynres, pending->render_ns,
+			output->pacing.period_ns * output->interval))
+		dynres_report(screen);
+
+	if (drm.opts.render_late)
+		pacing_frame_done(&output->pacing, pending->target_seq,
+				pending->flip_seq);
+	pacing_vblank(&output->pacing, pending->flip_seq, pending->flip_ns);
+
+	/* release last buffer to render on again: */
+	if (screen->scanout.bo)
+		release_buffer(screen->gbm, screen->scanout.bo);
+	screen->scanout = *pending;
+	pending->bo = NULL;
+
+	/* with an interval, commit once the vblank before the one the next
+	 * frame is due on has passed, so it lands on that one:
+	 */
+	if (output->interval > 1) {
+		screen->hold = 1;
+		if (drm_request_vblank(drm.fd, output,
+				screen->scanout.flip_seq + output->interval - 1, screen)) {
+			printf("failed to request vblank event: %s\n", strerror(errno));
+			screen->hold = 0;
 		}
+	}
 
-		egl->draw(i++);
+	/* if it is on screen, the gpu is long done with it: */
+	if (screen->scanout.gpu_fence_fd != -1) {
+		close(screen->scanout.gpu_fence_fd);
+		screen->scanout.gpu_fence_fd = -1;
+	}
+}
 
-		/* insert fence to be singled in cmdstream.. this fence will be
-		 * signaled when gpu rendering done
-		 */
-		gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
-		assert(gpu_fence);
+/* The first output renders with the gbm and egl surfaces it was given,
+ * the others get surfaces of their own, sharing the gbm device and egl
+ * context:
+ */
+static int init_screens(const struct gbm *gbm, const struct egl *egl)
+{
+	unsigned int i;
 
-		eglSwapBuffers(egl->display, egl->surface);
+	for (i = 0; i < drm.num_outputs; i++) {
+		struct screen *screen = &screens[i];
+		struct output *output = &drm.outputs[i];
 
-		/* after swapbuffers, gpu_fence should be flushed, so safe
-		 * to get fd:
+		screen->output = output;
+		screen->dirty = 1;
+		screen->first = 1;
+		/* Allow a modeset change for the first commit only, and not
+		 * even that if the mode we want is already set:
 		 */
-		drm.kms_in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
-		egl->eglDestroySyncKHR(egl->display, gpu_fence);
-		assert(drm.kms_in_fence_fd != -1);
+		screen->flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+		if (!output->adopted)
+			screen->flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		if (i == 0) {
+			screen->gbm = gbm;
+			screen->surface = egl->surface;
+		} else {
+			uint64_t *plane_modifiers = NULL;
+			const uint64_t *modifiers = NULL;
+			int count = 0, width, height;
+
+			/* the same choice as for the first output: */
+			if (drm.opts.modifier != DRM_FORMAT_MOD_INVALID) {
+				modifiers = &drm.opts.modifier;
+				count = 1;
+			}
+#ifdef HAVE_GBM_MODIFIERS
+			else {
+				count = drm_get_modifiers(drm.fd, output, gbm->format,
+						&plane_modifiers);
+				modifiers = plane_modifiers;
+			}
+#endif
+			output_render_size(&drm, output, &width, &height);
+			screen->gbm = init_gbm_output(gbm, width, height,
+					modifiers, count);
+			free(plane_modifiers);
+			if (!screen->gbm)
+				return -1;
 
-		next_bo = gbm_surface_lock_front_buffer(gbm->surface);
-		if (!next_bo) {
-			printf("Failed to lock frontbuffer\n");
-			return -1;
+			if (screen->gbm->ring) {
+				if (init_egl_ring(egl, screen->gbm))
+					return -1;
+				screen->surface = EGL_NO_SURFACE;
+			} else {
+				screen->surface = init_egl_surface(egl, screen->gbm);
+				if (screen->surface == EGL_NO_SURFACE)
+					return -1;
+			}
 		}
-		fb = drm_fb_get_from_bo(next_bo);
-		if (!fb) {
-			printf("Failed to get a new framebuffer BO\n");
+
+		if (drm_fb_init_ring(screen->gbm)) {
+			printf("failed to create fbs for the buffer ring\n");
 			return -1;
 		}
 
-		if (kms_fence) {
-			EGLint status;
+		printf("output %u: connector %u, crtc %u, %ux%u, every %u vblank(s)\n",
+				i, output->connector_id, output->crtc_id,
+				output->mode->hdisplay, output->mode->vdisplay,
+				output->interval);
+		if (screen->gbm->width != output->mode->hdisplay ||
+		    screen->gbm->height != output->mode->vdisplay)
+			printf("output %u: rendering at %dx%d, scaled up by the plane\n",
+					i, screen->gbm->width, screen->gbm->height);
+	}
+
+	return 0;
+}
+
+/* Everything we wait for, flip events on the drm fd and the gpu fences
+ * of frames still being rendered, for all outputs, goes through a single
+ * poll(), which only blocks when there is nothing to commit and nothing to
+ * render into.  A buffer is only released once the flip replacing it has
+ * completed, so the gpu never has to wait on kms before rendering the
+ * next frame.
+ */
+static int atomic_run(const struct gbm *gbm, const struct egl *egl)
+{
+	drmEventContext evctx = {
+			.version = 2,
+			.page_flip_handler = page_flip_handler,
+			.vblank_handler = vblank_handler,
+	};
+	struct frame *frames[MAX_OUTPUTS * (MAX_FRAMES_IN_FLIGHT + 1) + 2];
+	struct pollfd fds[MAX_OUTPUTS * (MAX_FRAMES_IN_FLIGHT + 1) + 2];
+	int has_in_fence = 1;
+	sigset_t mask;
+	struct run run;
+	unsigned int i, j;
+	int sfd, done = 0, ret;
+
+	if (egl_check(egl, eglDupNativeFenceFDANDROID) ||
+	    egl_check(egl, eglCreateSyncKHR) ||
+	    egl_check(egl, eglDestroySyncKHR))
+		return -1;
+
+	/* the egl surface can end up on any of them: */
+	for (i = 0; i < drm.num_outputs; i++)
+		for (j = 0; j < drm.outputs[i].num_planes; j++)
+			if (drm.outputs[i].planes[j]->type != DRM_PLANE_TYPE_CURSOR &&
+			    !drm.outputs[i].planes[j]->prop_id[PLANE_PROP_IN_FENCE_FD])
+				has_in_fence = 0;
+
+	/* an async flip can't take an in-fence either: */
+	if (drm.opts.async_flip)
+		has_in_fence = 0;
+	else if (!has_in_fence)
+		printf("no IN_FENCE_FD, waiting for the gpu before each commit\n");
+
+	if (init_screens(gbm, egl))
+		return -1;
+
+	/* frames may only fill part of the buffer, see render_frame(): */
+	if (drm.opts.dynamic_res)
+		glEnable(GL_SCISSOR_TEST);
+
+	/* SIGINT/SIGTERM come in through a signalfd, so the stats get
+	 * printed on the way out:
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sfd < 0) {
+		printf("signalfd failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* the first frames are composited by the gpu, until we know the
+	 * video can go on a plane.  The scene only has the one underlay,
+	 * so that's for a single output only, and async flips only take
+	 * the one plane.
+	 */
+	if (egl->underlay)
+		egl->underlay->state = (drm.opts.video_plane && drm.num_outputs == 1 &&
+				!drm.opts.async_flip) ?
+				UNDERLAY_PROBE : UNDERLAY_OFF;
+
+	/* the first output's flips count for --frames: */
+	run_start(&run, drm.opts.max_frames, drm.opts.duration);
+	animation_start_ns = run.start_ns;
+
+	while (!done) {
+		uint64_t now = get_time_ns(), wake = UINT64_MAX;
+		struct timespec timeout = { 0 };
+		unsigned int nfds = 0;
+
+		fds[nfds++] = (struct pollfd){ .fd = drm.fd, .events = POLLIN };
+		fds[nfds++] = (struct pollfd){ .fd = sfd, .events = POLLIN };
+
+		for (i = 0; i < drm.num_outputs; i++) {
+			struct screen *screen = &screens[i];
+			unsigned int target_seq;
+
+			if (can_commit(screen, has_in_fence))
+				wake = now;
+			else if (render_start(screen, &target_seq) < wake)
+				wake = render_start(screen, &target_seq);
+
+			/* gpu fences of the queued frames, and the pending one: */
+			for (j = 0; j <= screen->count; j++) {
+				struct frame *f = (j < screen->count) ?
+						&screen->queue[(screen->head + j) % MAX_FRAMES_IN_FLIGHT] :
+						&screen->pending;
+
+				if (!f->bo || f->gpu_fence_fd == -1)
+					continue;
+
+				frames[nfds] = f;
+				fds[nfds++] = (struct pollfd){
+					.fd = f->gpu_fence_fd,
+					.events = POLLIN,
+				};
+			}
+		}
+
+		/* sleep until something happens, or it's time to render: */
+		if (wake != UINT64_MAX && wake > now) {
+			timeout.tv_sec = (wake - now) / 1000000000;
+			timeout.tv_nsec = (wake - now) % 1000000000;
+		}
+
+		ret = ppoll(fds, nfds, (wake == UINT64_MAX) ? NULL : &timeout, NULL);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN) {
+			printf("poll err: %s\n", strerror(errno));
+			return ret;
+		}
+
+		if (ret > 0 && fds[1].revents) {
+			struct signalfd_siginfo info;
+
+			if (read(sfd, &info, sizeof(info)) == sizeof(info))
+				printf("got signal %u, exiting\n", info.ssi_signo);
+			break;
+		}
 
-			/* Wait on the CPU side for the _previous_ commit to
-			 * complete before we post the flip through KMS, as
-			 * atomic will reject the commit if we post a new one
-			 * whilst the previous one is still pending.
+		for (j = 2; ret > 0 && j < nfds; j++) {
+			if (!fds[j].revents)
+				continue;
+			/* gpu is done with this frame (any output's pacing is
+			 * as good as another's for the render time):
 			 */
-			do {
-				status = egl->eglClientWaitSyncKHR(egl->display,
-								   kms_fence,
-								   0,
-								   EGL_FOREVER_KHR);
-			} while (status != EGL_CONDITION_SATISFIED_KHR);
-
-			egl->eglDestroySyncKHR(egl->display, kms_fence);
+			frames[j]->render_ns = get_time_ns() - frames[j]->start_ns;
+			for (i = 0; i < drm.num_outputs; i++)
+				pacing_render_time(&drm.outputs[i].pacing,
+						frames[j]->render_ns);
+			close(frames[j]->gpu_fence_fd);
+			frames[j]->gpu_fence_fd = -1;
 		}
 
-		/*
-		 * Here you could also update drm plane layers if you want
-		 * hw composition
-		 */
-		ret = drm_atomic_commit(fb->fb_id, flags);
-		if (ret) {
-			printf("failed to commit: %s\n", strerror(errno));
-			return -1;
+		if (ret > 0 && fds[0].revents) {
+			drmHandleEvent(drm.fd, &evctx);
+
+			for (i = 0; i < drm.num_outputs; i++) {
+				if (screens[i].pending.bo && screens[i].pending.flipped) {
+					flip_done(&screens[i]);
+					if (i == 0 && run_frame(&run))
+						done = 1;
+				}
+			}
+			if (done)
+				break;
 		}
 
-		/* release last buffer to render on again: */
-		if (bo)
-			gbm_surface_release_buffer(gbm->surface, bo);
-		bo = next_bo;
+		for (i = 0; i < drm.num_outputs; i++) {
+			if (!screens[i].pending.bo)
+				drop_late_frames(&screens[i], has_in_fence);
+			if (can_commit(&screens[i], has_in_fence)) {
+				ret = commit_next(&screens[i], egl);
+				if (ret)
+					return ret;
+			}
+		}
 
-		/* Allow a modeset change for the first commit only. */
-		flags &= ~(DRM_MODE_ATOMIC_ALLOW_MODESET);
+		for (i = 0; i < drm.num_outputs; i++) {
+			struct screen *screen = &screens[i];
+			unsigned int target_seq;
+
+			if (render_start(screen, &target_seq) <= get_time_ns()) {
+				struct frame *frame = &screen->queue[
+						(screen->head + screen->count) % MAX_FRAMES_IN_FLIGHT];
+
+				ret = render_frame(screen, egl, frame, target_seq);
+				if (ret < 0)
+					return ret;
+				if (ret == 0)
+					screen->count++;
+				/* idle, no flips to end the run on: */
+				else if (run_expired(&run))
+					done = 1;
+			}
+		}
 	}
 
-	return ret;
+	for (i = 0; i < drm.num_outputs; i++)
+		stats_report(&drm.outputs[i].stats, &drm.outputs[i], 1,
+				drm.opts.stats_json);
+	run_report(&run, drm.opts.stats_json);
+
+	close(sfd);
+
+	return 0;
 }
 
-/* Pick a plane.. something that at a minimum can be connected to
- * the chosen crtc, but prefer primary plane.
- *
- * Seems like there is some room for a drmModeObjectGetNamedProperty()
- * type helper in libdrm..
- */
-static int get_plane_id(void)
+static int get_plane(struct plane *plane, uint32_t id)
 {
-	drmModePlaneResPtr plane_resources;
-	uint32_t i, j;
-	int ret = -EINVAL;
-	int found_primary = 0;
+	uint32_t i;
 
-	plane_resources = drmModeGetPlaneResources(drm.fd);
-	if (!plane_resources) {
-		printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+	plane->plane = drmModeGetPlane(drm.fd, id);
+	if (!plane->plane) {
+		printf("could not get plane %u: %s\n", id, strerror(errno));
 		return -1;
 	}
 
-	for (i = 0; (i < plane_resources->count_planes) && !found_primary; i++) {
-		uint32_t id = plane_resources->planes[i];
-		drmModePlanePtr plane = drmModeGetPlane(drm.fd, id);
-		if (!plane) {
-			printf("drmModeGetPlane(%u) failed: %s\n", id, strerror(errno));
-			continue;
-		}
+	plane->props = drmModeObjectGetProperties(drm.fd, id, DRM_MODE_OBJECT_PLANE);
+	if (!plane->props) {
+		printf("could not get plane %u properties: %s\n", id, strerror(errno));
+		return -1;
+	}
 
-		if (plane->possible_crtcs & (1 << drm.crtc_index)) {
-			drmModeObjectPropertiesPtr props =
-				drmModeObjectGetProperties(drm.fd, id, DRM_MODE_OBJECT_PLANE);
+	plane->props_info = calloc(plane->props->count_props,
+			sizeof(*plane->props_info));
+	for (i = 0; i < plane->props->count_props; i++)
+		plane->props_info[i] = drmModeGetProperty(drm.fd, plane->props->props[i]);
 
-			/* primary or not, this plane is good enough to use: */
-			ret = id;
+	return find_prop_ids(plane->prop_id, plane_prop_names,
+			ARRAY_SIZE(plane_prop_names), plane->props,
+			plane->props_info, "plane");
+}
 
-			for (j = 0; j < props->count_props; j++) {
-				drmModePropertyPtr p =
-					drmModeGetProperty(drm.fd, props->props[j]);
+static void free_plane(struct plane *plane)
+{
+	uint32_t i;
 
-				if ((strcmp(p->name, "type") == 0) &&
-						(props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY)) {
-					/* found our primary plane, lets use that: */
-					found_primary = 1;
-				}
+	if (plane->props) {
+		for (i = 0; i < plane->props->count_props; i++)
+			drmModeFreeProperty(plane->props_info[i]);
+		drmModeFreeObjectProperties(plane->props);
+	}
+	free(plane->props_info);
+	drmModeFreePlane(plane->plane);
+	free(plane);
+}
 
-				drmModeFreeProperty(p);
-			}
+static const drmModePropertyRes * find_prop(const struct plane *plane,
+		const char *name, uint64_t *value)
+{
+	uint32_t i;
 
-			drmModeFreeObjectProperties(props);
+	for (i = 0; i < plane->props->count_props; i++) {
+		if (strcmp(plane->props_info[i]->name, name) == 0) {
+			*value = plane->props->prop_values[i];
+			return plane->props_info[i];
 		}
+	}
+
+	return NULL;
+}
 
-		drmModeFreePlane(plane);
+static const char * plane_type_name(uint64_t type)
+{
+	switch (type) {
+	case DRM_PLANE_TYPE_PRIMARY: return "primary";
+	case DRM_PLANE_TYPE_CURSOR:  return "cursor";
+	default:                     return "overlay";
 	}
+}
 
-	drmModeFreePlaneResources(plane_resources);
+static int plane_claimed(uint32_t id)
+{
+	unsigned int i, j;
 
-	return ret;
+	for (i = 0; i < drm.num_outputs; i++)
+		for (j = 0; j < drm.outputs[i].num_planes; j++)
+			if (drm.outputs[i].planes[j]->plane->plane_id == id)
+				return 1;
+
+	return 0;
 }
 
-const struct drm * init_drm_atomic(const char *device)
+/* Take stock of the planes we can use with the output's crtc: the ones
+ * that can be connected to it, and aren't in use by another crtc or
+ * taken by an output before it.  Whether a plane can scale isn't exposed,
+ * we learn that from test commits.
+ */
+static int get_planes(struct output *output)
 {
-	uint32_t plane_id;
-	int ret;
+	drmModePlaneResPtr plane_resources;
+	uint32_t i;
 
-	ret = init_drm(&drm, device);
-	if (ret)
-		return NULL;
+	plane_resources = drmModeGetPlaneResources(drm.fd);
+	if (!plane_resources) {
+		printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+		return -1;
+	}
 
-	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		printf("no atomic modesetting support: %s\n", strerror(errno));
-		return NULL;
+	for (i = 0; i < plane_resources->count_planes; i++) {
+		uint32_t id = plane_resources->planes[i];
+		struct plane *plane;
+		const drmModePropertyRes *info;
+		uint64_t value;
+
+		if (plane_claimed(id))
+			continue;
+
+		plane = calloc(1, sizeof(*plane));
+		if (get_plane(plane, id) ||
+		    !(plane->plane->possible_crtcs & (1 << output->crtc_index)) ||
+		    (plane->plane->crtc_id && plane->plane->crtc_id != output->crtc_id) ||
+		    output->num_planes == MAX_PLANES) {
+			free_plane(plane);
+			continue;
+		}
+
+		plane->type = DRM_PLANE_TYPE_OVERLAY;
+		if (find_prop(plane, "type", &value))
+			plane->type = value;
+
+		info = find_prop(plane, "zpos", &value);
+		if (info) {
+			plane->has_zpos = 1;
+			if ((info->flags & DRM_MODE_PROP_IMMUTABLE) ||
+			    !(info->flags & DRM_MODE_PROP_RANGE) ||
+			    info->count_values < 2) {
+				plane->zpos_min = plane->zpos_max = value;
+			} else {
+				plane->zpos_min = info->values[0];
+				plane->zpos_max = info->values[1];
+			}
+		}
+
+		printf("plane %u: %s, %u formats", id, plane_type_name(plane->type),
+				plane->plane->count_formats);
+		if (plane->has_zpos)
+			printf(", zpos %"PRIu64"-%"PRIu64, plane->zpos_min, plane->zpos_max);
+		printf("\n");
+
+		output->planes[output->num_planes++] = plane;
 	}
 
-	ret = get_plane_id();
-	if (!ret) {
-		printf("could not find a suitable plane\n");
-		return NULL;
-	} else {
-		plane_id = ret;
+	drmModeFreePlaneResources(plane_resources);
+
+	if (!output->num_planes) {
+		printf("could not find a suitable plane for crtc %u\n",
+				output->crtc_id);
+		return -1;
 	}
 
-	/* We only do single plane to single crtc to single connector, no
-	 * fancy multi-monitor or multi-plane stuff.  So just grab the
-	 * plane/crtc/connector property info for one of each:
-	 */
-	drm.plane = calloc(1, sizeof(*drm.plane));
-	drm.crtc = calloc(1, sizeof(*drm.crtc));
-	drm.connector = calloc(1, sizeof(*drm.connector));
+	return 0;
+}
+
+/* Grab the crtc/connector property info for the output: */
+static int get_output_props(struct output *output)
+{
+	output->crtc = calloc(1, sizeof(*output->crtc));
+	output->connector = calloc(1, sizeof(*output->connector));
 
 #define get_resource(type, Type, id) do { 					\
-		drm.type->type = drmModeGet##Type(drm.fd, id);			\
-		if (!drm.type->type) {						\
+		output->type->type = drmModeGet##Type(drm.fd, id);		\
+		if (!output->type->type) {					\
 			printf("could not get %s %i: %s\n",			\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
 	} while (0)
 
-	get_resource(plane, Plane, plane_id);
-	get_resource(crtc, Crtc, drm.crtc_id);
-	get_resource(connector, Connector, drm.connector_id);
+	get_resource(crtc, Crtc, output->crtc_id);
+	get_resource(connector, Connector, output->connector_id);
 
 #define get_properties(type, TYPE, id) do {					\
 		uint32_t i;							\
-		drm.type->props = drmModeObjectGetProperties(drm.fd,		\
+		output->type->props = drmModeObjectGetProperties(drm.fd,	\
 				id, DRM_MODE_OBJECT_##TYPE);			\
-		if (!drm.type->props) {						\
+		if (!output->type->props) {					\
 			printf("could not get %s %u properties: %s\n", 		\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
-		drm.type->props_info = calloc(drm.type->props->count_props,	\
-				sizeof(drm.type->props_info));			\
-		for (i = 0; i < drm.type->props->count_props; i++) {		\
-			drm.type->props_info[i] = drmModeGetProperty(drm.fd,	\
-					drm.type->props->props[i]);		\
+		output->type->props_info = calloc(output->type->props->count_props, \
+				sizeof(output->type->props_info));		\
+		for (i = 0; i < output->type->props->count_props; i++) {	\
+			output->type->props_info[i] = drmModeGetProperty(drm.fd, \
+					output->type->props->props[i]);		\
 		}								\
 	} while (0)
 
-	get_properties(plane, PLANE, plane_id);
-	get_properties(crtc, CRTC, drm.crtc_id);
-	get_properties(connector, CONNECTOR, drm.connector_id);
+	get_properties(crtc, CRTC, output->crtc_id);
+	get_properties(connector, CONNECTOR, output->connector_id);
+
+#define get_prop_ids(type) do {							\
+		if (find_prop_ids(output->type->prop_id, type##_prop_names,	\
+				ARRAY_SIZE(type##_prop_names), output->type->props, \
+				output->type->props_info, #type))		\
+			return -1;						\
+	} while (0)
+
+	get_prop_ids(crtc);
+	get_prop_ids(connector);
+
+	if (drm.opts.vrr) {
+		const struct connector *c = output->connector;
+		uint32_t i;
+
+		for (i = 0; i < c->props->count_props; i++)
+			if (c->props->props[i] == c->prop_id[CONNECTOR_PROP_VRR_CAPABLE])
+				output->vrr = c->props->prop_values[i] &&
+						output->crtc->prop_id[CRTC_PROP_VRR_ENABLED];
+
+		if (!output->vrr)
+			printf("connector %u is not vrr capable\n",
+					output->connector_id);
+	}
+
+	/* one blob for the mode, however many (test) commits set it: */
+	if (drmModeCreatePropertyBlob(drm.fd, output->mode,
+			sizeof(*output->mode), &output->mode_blob_id)) {
+		printf("failed to create mode blob: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct drm * init_drm_atomic(const char *device, const struct drm_options *opts)
+{
+	unsigned int i, num_outputs;
+	int ret;
+
+	drm.opts = *opts;
+	if (drm.opts.frames_in_flight < 1 ||
+	    drm.opts.frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+		printf("frames in flight must be between 1 and %d\n",
+				MAX_FRAMES_IN_FLIGHT);
+		return NULL;
+	}
+	if (drm.opts.render_scale < 0.1 || drm.opts.render_scale > 1) {
+		printf("render scale must be between 0.1 and 1\n");
+		return NULL;
+	}
+
+	ret = init_drm(&drm, device);
+	if (ret)
+		return NULL;
+
+	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		printf("no atomic modesetting support: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (drm.opts.async_flip) {
+		uint64_t cap = 0;
+
+		if (drmGetCap(drm.fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) || !cap) {
+			printf("no atomic async page flips, flipping on vblank\n");
+			drm.opts.async_flip = 0;
+		} else {
+			/* frames go out as soon as they're done: */
+			drm.opts.render_late = 0;
+			for (i = 0; i < drm.num_outputs; i++)
+				drm.outputs[i].interval = 1;
+			/* an async flip can only switch fbs, not resize the
+			 * layer (or anything else a test commit resends):
+			 */
+			if (drm.opts.dynamic_res) {
+				printf("no dynamic resolution with async flips\n");
+				drm.opts.dynamic_res = 0;
+			}
+		}
+	}
+
+	/* plane_claimed() looks at the outputs set up so far: */
+	num_outputs = drm.num_outputs;
+	for (i = 0; i < num_outputs; i++) {
+		drm.num_outputs = i;
+		if (get_planes(&drm.outputs[i]))
+			return NULL;
+	}
+	drm.num_outputs = num_outputs;
+
+	for (i = 0; i < drm.num_outputs; i++)
+		if (get_output_props(&drm.outputs[i]))
+			return NULL;
+
+	drm.req = drmModeAtomicAlloc();
+	if (!drm.req) {
+		printf("could not allocate atomic request\n");
+		return NULL;
+	}
 
 	drm.run = atomic_run;
 
@@ -24,9 +24,11 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "common.h"
 #include "drm-common.h"
@@ -47,7 +49,7 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 {
 	int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
 	struct drm_fb *fb = gbm_bo_get_user_data(bo);
-	uint32_t width, height,
+	uint32_t width, height, format,
 		 strides[4] = {0}, handles[4] = {0},
 		 offsets[4] = {0}, flags = 0;
 	int ret = -1;
@@ -60,35 +62,43 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 
 	width = gbm_bo_get_width(bo);
 	height = gbm_bo_get_height(bo);
+	format = gbm_bo_get_format(bo);
 
+	/* Each plane, be it of a multi-planar format like NV12 or the aux
+	 * plane of a compressed modifier, can be in a gem object of its own:
+	 */
 #ifdef HAVE_GBM_MODIFIERS
 	uint64_t modifiers[4] = {0};
 	modifiers[0] = gbm_bo_get_modifier(bo);
-	const int num_planes = gbm_bo_get_plane_count(bo);
+	int num_planes = gbm_bo_get_plane_count(bo);
+	if (num_planes > 4)
+		num_planes = 4;
 	for (int i = 0; i < num_planes; i++) {
 		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-		handles[i] = gbm_bo_get_handle(bo).u32;
+		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
 		offsets[i] = gbm_bo_get_offset(bo, i);
 		modifiers[i] = modifiers[0];
 	}
 
-	if (modifiers[0]) {
+	if (modifiers[0] != DRM_FORMAT_MOD_INVALID) {
 		flags = DRM_MODE_FB_MODIFIERS;
-		printf("Using modifier %" PRIx64 "\n", modifiers[0]);
+		printf("Using modifier %" PRIx64 " (%.4s, %d plane(s))\n",
+				modifiers[0], (char *)&format, num_planes);
 	}
 
 	ret = drmModeAddFB2WithModifiers(drm_fd, width, height,
-			DRM_FORMAT_XRGB8888, handles, strides, offsets,
+			format, handles, strides, offsets,
 			modifiers, &fb->fb_id, flags);
+#else
+	handles[0] = gbm_bo_get_handle(bo).u32;
+	strides[0] = gbm_bo_get_stride(bo);
 #endif
 	if (ret) {
 		if (flags)
 			fprintf(stderr, "Modifiers failed!\n");
 
-		memcpy(handles, (uint32_t [4]){gbm_bo_get_handle(bo).u32,0,0,0}, 16);
-		memcpy(strides, (uint32_t [4]){gbm_bo_get_stride(bo),0,0,0}, 16);
-		memset(offsets, 0, 16);
-		ret = drmModeAddFB2(drm_fd, width, height, DRM_FORMAT_XRGB8888,
+		/* the same planes, with the modifier left implicit: */
+		ret = drmModeAddFB2(drm_fd, width, height, format,
 				handles, strides, offsets, &fb->fb_id, 0);
 	}
 
@@ -103,8 +113,191 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 	return fb;
 }
 
-static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
-		const drmModeEncoder *encoder) {
+/* With a buffer ring, create all the fbs up front so no frame has to: */
+int drm_fb_init_ring(const struct gbm *gbm)
+{
+	unsigned int i;
+
+	if (!gbm->ring)
+		return 0;
+
+	for (i = 0; i < gbm->ring->num_buffers; i++)
+		if (!drm_fb_get_from_bo(gbm->ring->buffers[i].bo))
+			return -1;
+
+	return 0;
+}
+
+static int parse_in_formats(int fd, uint32_t blob_id, uint32_t format,
+		uint64_t **modifiers)
+{
+	const struct drm_format_modifier_blob *header;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	drmModePropertyBlobRes *blob;
+	uint32_t i, j;
+	int count = 0;
+
+	blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!blob)
+		return 0;
+
+	header = blob->data;
+	formats = (const uint32_t *)((const char *)header + header->formats_offset);
+	mods = (const struct drm_format_modifier *)
+			((const char *)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_formats; i++)
+		if (formats[i] == format)
+			break;
+
+	/* each modifier applies to a 64 format window, starting at offset: */
+	if (i < header->count_formats) {
+		*modifiers = calloc(header->count_modifiers, sizeof(**modifiers));
+		for (j = 0; j < header->count_modifiers; j++) {
+			if (i < mods[j].offset || i >= mods[j].offset + 64)
+				continue;
+			if (!(mods[j].formats & (1ULL << (i - mods[j].offset))))
+				continue;
+			(*modifiers)[count++] = mods[j].modifier;
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+
+	if (!count) {
+		free(*modifiers);
+		*modifiers = NULL;
+	}
+
+	return count;
+}
+
+/* The primary plane of the output's crtc, and its IN_FORMATS blob if
+ * it has one, NULL if there is none to be found:
+ */
+static drmModePlane * get_primary_plane(int fd, const struct output *output,
+		uint64_t *in_formats)
+{
+	drmModePlaneResPtr plane_resources;
+	drmModePlane *primary = NULL;
+	uint32_t i, j;
+
+	/* legacy doesn't get to see the primary plane otherwise: */
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
+	plane_resources = drmModeGetPlaneResources(fd);
+	if (!plane_resources)
+		return NULL;
+
+	for (i = 0; i < plane_resources->count_planes; i++) {
+		uint32_t id = plane_resources->planes[i];
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY, blob_id = 0;
+		drmModeObjectProperties *props;
+		drmModePlane *plane;
+
+		plane = drmModeGetPlane(fd, id);
+		if (!plane)
+			continue;
+
+		if (!(plane->possible_crtcs & (1 << output->crtc_index))) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		props = drmModeObjectGetProperties(fd, id, DRM_MODE_OBJECT_PLANE);
+		for (j = 0; props && j < props->count_props; j++) {
+			drmModePropertyRes *p = drmModeGetProperty(fd, props->props[j]);
+
+			if (strcmp(p->name, "type") == 0)
+				type = props->prop_values[j];
+			else if (strcmp(p->name, "IN_FORMATS") == 0)
+				blob_id = props->prop_values[j];
+
+			drmModeFreeProperty(p);
+		}
+
+		drmModeFreeObjectProperties(props);
+
+		if (type != DRM_PLANE_TYPE_PRIMARY) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		*in_formats = blob_id;
+		primary = plane;
+		break;
+	}
+
+	drmModeFreePlaneResources(plane_resources);
+
+	return primary;
+}
+
+/* Modifiers that the primary plane of the output's crtc can scan out
+ * format with, from its IN_FORMATS property.  Returns how many there
+ * are (the caller frees the list), or 0 if the plane doesn't say, in
+ * which case gbm has to pick one implicitly.
+ */
+int drm_get_modifiers(int fd, const struct output *output, uint32_t format,
+		uint64_t **modifiers)
+{
+	drmModePlane *plane;
+	uint64_t blob_id = 0;
+	int count = 0;
+
+	*modifiers = NULL;
+
+	plane = get_primary_plane(fd, output, &blob_id);
+	if (!plane)
+		return 0;
+
+	if (blob_id)
+		count = parse_in_formats(fd, blob_id, format, modifiers);
+
+	printf("plane %u can scan out %.4s with %d modifiers\n",
+			plane->plane_id, (char *)&format, count);
+	drmModeFreePlane(plane);
+
+	return count;
+}
+
+/* Whether the primary plane of the output's crtc takes format at all,
+ * if we can't tell, assume it does and let the modeset find out:
+ */
+int drm_has_format(int fd, const struct output *output, uint32_t format)
+{
+	drmModePlane *plane;
+	uint64_t blob_id = 0;
+	uint32_t i;
+	int found;
+
+	plane = get_primary_plane(fd, output, &blob_id);
+	if (!plane)
+		return 1;
+
+	found = 0;
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == format)
+			found = 1;
+	drmModeFreePlane(plane);
+
+	return found;
+}
+
+static int crtc_in_use(const struct drm *drm, uint32_t crtc_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < drm->num_outputs; i++)
+		if (drm->outputs[i].crtc_id == crtc_id)
+			return 1;
+
+	return 0;
+}
+
+static uint32_t find_crtc_for_encoder(const struct drm *drm,
+		const drmModeRes *resources, const drmModeEncoder *encoder) {
 	int i;
 
 	for (i = 0; i < resources->count_crtcs; i++) {
@@ -113,7 +306,8 @@ static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
 		 */
 		const uint32_t crtc_mask = 1 << i;
 		const uint32_t crtc_id = resources->crtcs[i];
-		if (encoder->possible_crtcs & crtc_mask) {
+		if ((encoder->possible_crtcs & crtc_mask) &&
+		    !crtc_in_use(drm, crtc_id)) {
 			return crtc_id;
 		}
 	}
@@ -131,7 +325,7 @@ static uint32_t find_crtc_for_connector(const struct drm *drm, const drmModeRes
 		drmModeEncoder *encoder = drmModeGetEncoder(drm->fd, encoder_id);
 
 		if (encoder) {
-			const uint32_t crtc_id = find_crtc_for_encoder(resources, encoder);
+			const uint32_t crtc_id = find_crtc_for_encoder(drm, resources, encoder);
 
 			drmModeFreeEncoder(encoder);
 			if (crtc_id != 0) {
@@ -144,65 +338,221 @@ static uint32_t find_crtc_for_connector(const struct drm *drm, const drmModeRes
 	return -1;
 }
 
-int init_drm(struct drm *drm, const char *device)
+/* refresh rate in mHz, more precise than vrefresh: */
+static unsigned int mode_refresh(const drmModeModeInfo *mode)
 {
-	drmModeRes *resources;
-	drmModeConnector *connector = NULL;
-	drmModeEncoder *encoder = NULL;
-	int i, area;
+	uint64_t refresh;
 
-	drm->fd = open(device, O_RDWR);
+	if (!mode->htotal || !mode->vtotal)
+		return mode->vrefresh * 1000;
 
-	if (drm->fd < 0) {
-		printf("could not open drm device\n");
+	refresh = (uint64_t)mode->clock * 1000000 / mode->htotal / mode->vtotal;
+	if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+		refresh *= 2;
+	if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+		refresh /= 2;
+
+	return refresh;
+}
+
+static int mode_area(const drmModeModeInfo *mode)
+{
+	return mode->hdisplay * mode->vdisplay;
+}
+
+/* Parse an X11 style modeline: "clock hdisplay hsync_start hsync_end
+ * htotal vdisplay vsync_start vsync_end vtotal [flags]", with the clock
+ * in MHz and flags like +hsync, -vsync or interlace:
+ */
+static int parse_modeline(const char *str, drmModeModeInfo *mode)
+{
+	unsigned int h[4], v[4];
+	char flags[4][16];
+	double clock;
+	int i, n;
+
+	memset(mode, 0, sizeof(*mode));
+	memset(flags, 0, sizeof(flags));
+
+	n = sscanf(str, "%lf %u %u %u %u %u %u %u %u %15s %15s %15s %15s", &clock,
+			&h[0], &h[1], &h[2], &h[3], &v[0], &v[1], &v[2], &v[3],
+			flags[0], flags[1], flags[2], flags[3]);
+	if (n < 9)
 		return -1;
+
+	mode->clock = clock * 1000;
+	mode->hdisplay = h[0];
+	mode->hsync_start = h[1];
+	mode->hsync_end = h[2];
+	mode->htotal = h[3];
+	mode->vdisplay = v[0];
+	mode->vsync_start = v[1];
+	mode->vsync_end = v[2];
+	mode->vtotal = v[3];
+
+	for (i = 0; i < n - 9; i++) {
+		if (strcasecmp(flags[i], "+hsync") == 0)
+			mode->flags |= DRM_MODE_FLAG_PHSYNC;
+		else if (strcasecmp(flags[i], "-hsync") == 0)
+			mode->flags |= DRM_MODE_FLAG_NHSYNC;
+		else if (strcasecmp(flags[i], "+vsync") == 0)
+			mode->flags |= DRM_MODE_FLAG_PVSYNC;
+		else if (strcasecmp(flags[i], "-vsync") == 0)
+			mode->flags |= DRM_MODE_FLAG_NVSYNC;
+		else if (strcasecmp(flags[i], "interlace") == 0)
+			mode->flags |= DRM_MODE_FLAG_INTERLACE;
+		else if (strcasecmp(flags[i], "doublescan") == 0)
+			mode->flags |= DRM_MODE_FLAG_DBLSCAN;
+		else
+			return -1;
 	}
 
-	resources = drmModeGetResources(drm->fd);
-	if (!resources) {
-		printf("drmModeGetResources failed: %s\n", strerror(errno));
+	if (!mode->clock || !mode->htotal || !mode->vtotal ||
+	    mode->hdisplay > mode->hsync_start || mode->hsync_start > mode->hsync_end ||
+	    mode->hsync_end > mode->htotal || mode->vdisplay > mode->vsync_start ||
+	    mode->vsync_start > mode->vsync_end || mode->vsync_end > mode->vtotal)
 		return -1;
-	}
 
-	/* find a connected connector: */
-	for (i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
-		if (connector->connection == DRM_MODE_CONNECTED) {
-			/* it's connected, let's use this! */
-			break;
+	mode->vrefresh = (mode_refresh(mode) + 500) / 1000;
+	mode->type = DRM_MODE_TYPE_USERDEF;
+	snprintf(mode->name, sizeof(mode->name), "%ux%u", mode->hdisplay,
+			mode->vdisplay);
+
+	return 0;
+}
+
+/* Pick the connector's mode according to --display-mode:
+ *
+ *   (none)              the preferred mode, else the largest
+ *   largest             the largest, at the highest refresh
+ *   highest-refresh     the highest refresh, at the largest size
+ *   lowest-res-max-refresh  the smallest that has the highest refresh
+ *   WxH[@Hz]            that size, the closest refresh (or highest)
+ *   modeline:...        a custom mode, see parse_modeline()
+ */
+static drmModeModeInfo * select_mode(struct output *output,
+		drmModeConnector *connector, const char *policy)
+{
+	drmModeModeInfo *best = NULL;
+	unsigned int width = 0, height = 0, max_refresh = 0;
+	double hz = 0;
+	int i;
+
+	if (policy && strncmp(policy, "modeline:", 9) == 0) {
+		if (parse_modeline(policy + 9, &output->custom_mode)) {
+			printf("invalid modeline: %s\n", policy + 9);
+			return NULL;
 		}
-		drmModeFreeConnector(connector);
-		connector = NULL;
+		return &output->custom_mode;
 	}
 
-	if (!connector) {
-		/* we could be fancy and listen for hotplug events and wait for
-		 * a connector..
-		 */
-		printf("no connected connector!\n");
-		return -1;
+	for (i = 0; i < connector->count_modes; i++)
+		if (mode_refresh(&connector->modes[i]) > max_refresh)
+			max_refresh = mode_refresh(&connector->modes[i]);
+
+	if (!policy) {
+		for (i = 0; i < connector->count_modes; i++)
+			if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+				return &connector->modes[i];
+		policy = "largest";
+	} else if (strcmp(policy, "largest") != 0 &&
+		   strcmp(policy, "highest-refresh") != 0 &&
+		   strcmp(policy, "lowest-res-max-refresh") != 0 &&
+		   sscanf(policy, "%ux%u@%lf", &width, &height, &hz) < 2) {
+		printf("invalid display mode: %s\n", policy);
+		return NULL;
 	}
 
-	/* find preferred mode or the highest resolution mode: */
-	for (i = 0, area = 0; i < connector->count_modes; i++) {
-		drmModeModeInfo *current_mode = &connector->modes[i];
+	for (i = 0; i < connector->count_modes; i++) {
+		drmModeModeInfo *mode = &connector->modes[i];
+		unsigned int refresh = mode_refresh(mode);
+		int better;
 
-		if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-			drm->mode = current_mode;
-		}
+		if (!best) {
+			better = !width || (mode->hdisplay == width && mode->vdisplay == height);
+		} else if (width) {
+			/* closest refresh to what was asked for, or the highest: */
+			unsigned int want = hz ? hz * 1000 : max_refresh;
 
-		int current_area = current_mode->hdisplay * current_mode->vdisplay;
-		if (current_area > area) {
-			drm->mode = current_mode;
-			area = current_area;
+			better = mode->hdisplay == width && mode->vdisplay == height &&
+					abs((int)(refresh - want)) <
+					abs((int)(mode_refresh(best) - want));
+		} else if (strcmp(policy, "largest") == 0) {
+			better = mode_area(mode) > mode_area(best) ||
+					(mode_area(mode) == mode_area(best) &&
+					 refresh > mode_refresh(best));
+		} else if (strcmp(policy, "highest-refresh") == 0) {
+			better = refresh > mode_refresh(best) ||
+					(refresh == mode_refresh(best) &&
+					 mode_area(mode) > mode_area(best));
+		} else {
+			/* lowest-res-max-refresh, within 1Hz of the max: */
+			better = refresh + 1000 > max_refresh &&
+					(mode_refresh(best) + 1000 <= max_refresh ||
+					 mode_area(mode) < mode_area(best));
 		}
+
+		if (better)
+			best = mode;
+	}
+
+	if (!best)
+		printf("no %s mode on connector %u\n", policy,
+				connector->connector_id);
+
+	return best;
+}
+
+/* For --fast-start, take over the mode the connector's crtc is already
+ * showing (a boot splash, say), so we don't need the connector's mode
+ * list, and the first commit needs no modeset:
+ */
+static int adopt_current_mode(struct drm *drm, struct output *output,
+		const drmModeConnector *connector)
+{
+	drmModeEncoder *encoder;
+	drmModeCrtc *crtc = NULL;
+
+	encoder = drmModeGetEncoder(drm->fd, connector->encoder_id);
+	if (encoder && encoder->crtc_id && !crtc_in_use(drm, encoder->crtc_id))
+		crtc = drmModeGetCrtc(drm->fd, encoder->crtc_id);
+	drmModeFreeEncoder(encoder);
+
+	if (crtc && crtc->mode_valid) {
+		output->custom_mode = crtc->mode;
+		output->mode = &output->custom_mode;
+		output->adopted = 1;
 	}
+	drmModeFreeCrtc(crtc);
+
+	return output->adopted;
+}
+
+/* Set up the next output for a connected connector, which it takes
+ * ownership of (the mode points into it):
+ */
+static int init_output(struct drm *drm, const drmModeRes *resources,
+		drmModeConnector *connector)
+{
+	struct output *output = &drm->outputs[drm->num_outputs];
+	drmModeEncoder *encoder = NULL;
+	int i;
+
+	memset(output, 0, sizeof(*output));
 
-	if (!drm->mode) {
+	if (!drm->opts.fast_start || drm->opts.display_mode ||
+	    !adopt_current_mode(drm, output, connector))
+		output->mode = select_mode(output, connector, drm->opts.display_mode);
+	if (!output->mode) {
 		printf("could not find mode!\n");
 		return -1;
 	}
 
+	printf("connector %u: mode %ux%u@%.2f%s\n", connector->connector_id,
+			output->mode->hdisplay, output->mode->vdisplay,
+			mode_refresh(output->mode) / 1000.0,
+			output->adopted ? " (current)" : "");
+
 	/* find encoder: */
 	for (i = 0; i < resources->count_encoders; i++) {
 		encoder = drmModeGetEncoder(drm->fd, resources->encoders[i]);
@@ -212,28 +562,465 @@ int init_drm(struct drm *drm, const char *device)
 		encoder = NULL;
 	}
 
-	if (encoder) {
-		drm->crtc_id = encoder->crtc_id;
+	/* keep the crtc it already has, unless another output got it: */
+	if (encoder && encoder->crtc_id && !crtc_in_use(drm, encoder->crtc_id)) {
+		output->crtc_id = encoder->crtc_id;
 	} else {
 		uint32_t crtc_id = find_crtc_for_connector(drm, resources, connector);
-		if (crtc_id == 0) {
+		if (crtc_id == 0 || crtc_id == (uint32_t)-1) {
 			printf("no crtc found!\n");
+			drmModeFreeEncoder(encoder);
 			return -1;
 		}
 
-		drm->crtc_id = crtc_id;
+		output->crtc_id = crtc_id;
 	}
 
+	drmModeFreeEncoder(encoder);
+
 	for (i = 0; i < resources->count_crtcs; i++) {
-		if (resources->crtcs[i] == drm->crtc_id) {
-			drm->crtc_index = i;
+		if (resources->crtcs[i] == output->crtc_id) {
+			output->crtc_index = i;
 			break;
 		}
 	}
 
+	output->connector_id = connector->connector_id;
+
+	pacing_init(&output->pacing, output->mode);
+	dynres_init(&output->dynres);
+
+	output->interval = drm->opts.interval;
+	if (drm->opts.fps)
+		output->interval = (1000000000 / drm->opts.fps +
+				output->pacing.period_ns / 2) / output->pacing.period_ns;
+	if (!output->interval)
+		output->interval = 1;
+
+	drm->num_outputs++;
+
+	return 0;
+}
+
+/* When vblank seq is predicted to happen, or now if we have nothing to go
+ * on yet:
+ */
+uint64_t pacing_vblank_ns(const struct pacing *pacing, unsigned int seq,
+		uint64_t now)
+{
+	int delta = seq - pacing->vblank_seq;
+
+	if (!pacing->vblank_ns)
+		return now;
+
+	return pacing->vblank_ns + (int64_t)delta * (int64_t)pacing->period_ns;
+}
+
+/* Ask for a vblank event on the output's crtc once vblank seq has passed
+ * (right away if it already has), delivered to the vblank_handler with
+ * data:
+ */
+int drm_request_vblank(int fd, const struct output *output, unsigned int seq,
+		void *data)
+{
+	drmVBlank vbl = {
+		.request = {
+			.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+				((output->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				 DRM_VBLANK_HIGH_CRTC_MASK),
+			.sequence = seq,
+			.signal = (unsigned long)data,
+		},
+	};
+
+	return drmWaitVBlank(fd, &vbl);
+}
+
+/* Expects drm->opts to be set already. */
+int init_drm(struct drm *drm, const char *device)
+{
+	drmModeRes *resources;
+	drmModeConnector *connector = NULL;
+	int i;
+
+	drm->start_ns = get_time_ns();
+	drm->fd = open(device, O_RDWR);
+
+	if (drm->fd < 0) {
+		printf("could not open drm device\n");
+		return -1;
+	}
+
+	resources = drmModeGetResources(drm->fd);
+	if (!resources) {
+		printf("drmModeGetResources failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* find connected connectors, or just the first one.  Probing a
+	 * connector can take a while (EDID), with --fast-start we go with
+	 * what the kernel already knows if we can:
+	 */
+	for (i = 0; i < resources->count_connectors; i++) {
+		uint32_t id = resources->connectors[i];
+
+		connector = NULL;
+		if (drm->opts.fast_start) {
+			connector = drmModeGetConnectorCurrent(drm->fd, id);
+			/* only probe when the kernel doesn't know yet, or what
+			 * it knows doesn't work out:
+			 */
+			if (connector && connector->connection == DRM_MODE_DISCONNECTED) {
+				drmModeFreeConnector(connector);
+				continue;
+			}
+			if (connector && connector->connection == DRM_MODE_CONNECTED &&
+			    init_output(drm, resources, connector)) {
+				drmModeFreeConnector(connector);
+				connector = NULL;
+			}
+		}
+
+		if (!connector || connector->connection != DRM_MODE_CONNECTED) {
+			drmModeFreeConnector(connector);
+			connector = drmModeGetConnector(drm->fd, id);
+			if (!connector)
+				continue;
+			if (connector->connection != DRM_MODE_CONNECTED ||
+			    init_output(drm, resources, connector)) {
+				drmModeFreeConnector(connector);
+				continue;
+			}
+		}
+
+		if (!drm->opts.all_outputs || drm->num_outputs == MAX_OUTPUTS)
+			break;
+	}
+
 	drmModeFreeResources(resources);
 
-	drm->connector_id = connector->connector_id;
+	if (!drm->num_outputs) {
+		/* we could be fancy and listen for hotplug events and wait for
+		 * a connector..
+		 */
+		printf("no connected connector!\n");
+		return -1;
+	}
 
 	return 0;
 }
+
+#define PACING_MIN_MARGIN_NS 500000
+
+void pacing_init(struct pacing *pacing, const drmModeModeInfo *mode)
+{
+	memset(pacing, 0, sizeof(*pacing));
+
+	/* mode clock is in kHz: */
+	pacing->period_ns = (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+	pacing->margin_ns = pacing->period_ns / 8;
+}
+
+/* Called with the sequence number and timestamp of every completed flip. */
+void pacing_vblank(struct pacing *pacing, unsigned int seq, uint64_t ns)
+{
+	int delta = seq - pacing->vblank_seq;
+
+	/* the mode's nominal refresh is rarely exact, follow the real one: */
+	if (pacing->vblank_ns && delta > 0 && delta <= 4) {
+		uint64_t period = (ns - pacing->vblank_ns) / delta;
+		pacing->period_ns = (7 * pacing->period_ns + period) / 8;
+	}
+
+	pacing->vblank_seq = seq;
+	pacing->vblank_ns = ns;
+}
+
+/* Rise immediately on a slow frame, but decay slowly: */
+void pacing_render_time(struct pacing *pacing, uint64_t ns)
+{
+	if (ns > pacing->render_ns)
+		pacing->render_ns = ns;
+	else
+		pacing->render_ns -= (pacing->render_ns - ns) / 8;
+}
+
+/* When to start rendering a frame that has to land after vblank after_seq,
+ * as late as possible while still (hopefully) finishing in time.  Returns
+ * the start time, and the vblank we are aiming for in target_seq.
+ */
+uint64_t pacing_next_start(const struct pacing *pacing, uint64_t now,
+		unsigned int after_seq, unsigned int *target_seq)
+{
+	uint64_t budget = pacing->render_ns + pacing->margin_ns;
+	unsigned int target = after_seq + 1;
+	uint64_t vblank;
+
+	if ((int)(target - pacing->vblank_seq) <= 0)
+		target = pacing->vblank_seq + 1;
+
+	*target_seq = target;
+
+	/* nothing to go on yet, or the frame takes longer than a refresh
+	 * anyways, so there is no point in waiting:
+	 */
+	if (!pacing->vblank_ns || budget >= pacing->period_ns)
+		return now;
+
+	vblank = pacing->vblank_ns +
+			(uint64_t)(target - pacing->vblank_seq) * pacing->period_ns;
+
+	/* too late for that one, aim for the first one we can make: */
+	while (vblank < now + budget) {
+		vblank += pacing->period_ns;
+		target++;
+	}
+
+	*target_seq = target;
+
+	return vblank - budget;
+}
+
+/* Adapt the margin depending on whether a frame made its target vblank.
+ * Must be called before pacing_vblank() for the same flip.
+ */
+void pacing_frame_done(struct pacing *pacing, unsigned int target_seq,
+		unsigned int seq)
+{
+	/* the target was a guess without any vblank to go on: */
+	if (!pacing->vblank_ns)
+		return;
+
+	if ((int)(seq - target_seq) > 0) {
+		pacing->margin_ns *= 2;
+		if (pacing->margin_ns > pacing->period_ns / 2)
+			pacing->margin_ns = pacing->period_ns / 2;
+	} else {
+		pacing->margin_ns -= pacing->margin_ns / 16;
+		if (pacing->margin_ns < PACING_MIN_MARGIN_NS)
+			pacing->margin_ns = PACING_MIN_MARGIN_NS;
+	}
+}
+
+void dynres_init(struct dynres *dynres)
+{
+	memset(dynres, 0, sizeof(*dynres));
+	dynres->scale = 1.0;
+}
+
+/* Feed the time a frame took from the start of rendering until the gpu
+ * was done, against the time there is per frame.  Returns 1 if the scale
+ * changed.  The cost goes with the area, so when over budget jump to
+ * the scale that should make it fit, with some room to spare, and grow
+ * back a step at a time:
+ */
+int dynres_frame(struct dynres *dynres, uint64_t render_ns, uint64_t budget_ns)
+{
+	double scale = dynres->scale;
+
+	if (!dynres->frames++)
+		dynres->render_ns = render_ns;
+	else
+		dynres->render_ns += ((int64_t)render_ns - (int64_t)dynres->render_ns) / 8;
+
+	if (dynres->frames < DYNRES_HOLD_FRAMES || !budget_ns)
+		return 0;
+
+	if (dynres->render_ns > budget_ns * 9 / 10)
+		scale *= sqrt(0.75 * budget_ns / dynres->render_ns);
+	else if (dynres->render_ns < budget_ns * 6 / 10)
+		scale += DYNRES_STEP;
+
+	/* round down to whole steps: */
+	scale = floor(scale / DYNRES_STEP + 0.001) * DYNRES_STEP;
+	if (scale < DYNRES_MIN_SCALE)
+		scale = DYNRES_MIN_SCALE;
+	if (scale > 1.0)
+		scale = 1.0;
+
+	if (fabs(scale - dynres->scale) < DYNRES_STEP / 2)
+		return 0;
+
+	dynres->scale = scale;
+	dynres->frames = 0;
+
+	return 1;
+}
+
+/* The viewport in a buffer of width x height, kept even like the
+ * render scale:
+ */
+void dynres_size(const struct dynres *dynres, int width, int height,
+		int *w, int *h)
+{
+	if (dynres->scale >= 1.0) {
+		*w = width;
+		*h = height;
+		return;
+	}
+
+	*w = ((int)(width * dynres->scale) + 1) & ~1;
+	*h = ((int)(height * dynres->scale) + 1) & ~1;
+	if (*w > width)
+		*w = width;
+	if (*h > height)
+		*h = height;
+}
+
+static void stats_record(struct frame_stats *fs, int first, unsigned int missed,
+		uint64_t interval, uint64_t ns)
+{
+	unsigned int bucket;
+
+	if (!fs->frames++)
+		fs->start_ns = ns;
+	if (first)
+		return;
+
+	fs->missed += missed;
+	fs->count++;
+	fs->sum_ns += interval;
+	if (!fs->min_ns || interval < fs->min_ns)
+		fs->min_ns = interval;
+	if (interval > fs->max_ns)
+		fs->max_ns = interval;
+
+	bucket = interval / STATS_BUCKET_NS;
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	fs->hist[bucket]++;
+}
+
+/* Record a flip on vblank seq at ns.  An interval of 0 means vblanks don't
+ * pace the flips (vrr, async), so there are no missed vblanks to count.
+ * Returns 1 when it is time for a report.
+ */
+int stats_flip(struct stats *stats, unsigned int seq, uint64_t ns,
+		unsigned int interval)
+{
+	int first = !stats->last_ns;
+	unsigned int missed = 0;
+
+	if (!first && interval && seq - stats->last_seq > interval)
+		missed = seq - stats->last_seq - interval;
+
+	stats_record(&stats->period, first, missed, ns - stats->last_ns, ns);
+	stats_record(&stats->total, first, missed, ns - stats->last_ns, ns);
+
+	stats->last_seq = seq;
+	stats->last_ns = ns;
+
+	return ns - stats->period.start_ns >= STATS_PERIOD_NS;
+}
+
+void stats_drop(struct stats *stats)
+{
+	stats->period.dropped++;
+	stats->total.dropped++;
+}
+
+/* Upper end of the bucket the given fraction of intervals falls in, ms: */
+static double stats_percentile(const struct frame_stats *fs, double fraction)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		n += fs->hist[i];
+		if (n >= fs->count * fraction)
+			break;
+	}
+
+	return (i + 1) * STATS_BUCKET_NS / 1e6;
+}
+
+/* Print the stats since the last report, or with final for the whole
+ * run, and start a new period.
+ */
+void stats_report(struct stats *stats, const struct output *output,
+		int final, int json)
+{
+	const struct frame_stats *fs = final ? &stats->total : &stats->period;
+	double secs = (stats->last_ns - fs->start_ns) / 1e9;
+	double fps = (fs->count && secs > 0) ? fs->count / secs : 0;
+	const char *sep = "";
+	unsigned int i;
+
+	if (!fs->frames)
+		return;
+
+	if (json) {
+		printf("{\"connector\": %u, \"final\": %s, \"seconds\": %.3f, "
+				"\"frames\": %u, \"fps\": %.2f, \"missed\": %u, \"dropped\": %u",
+				output->connector_id, final ? "true" : "false", secs,
+				fs->frames, fps, fs->missed, fs->dropped);
+		if (fs->count) {
+			printf(", \"interval_ms\": {\"min\": %.3f, \"mean\": %.3f, "
+					"\"p50\": %.1f, \"p95\": %.1f, \"p99\": %.1f, "
+					"\"max\": %.3f}, \"histogram\": [",
+					fs->min_ns / 1e6, fs->sum_ns / 1e6 / fs->count,
+					stats_percentile(fs, 0.5), stats_percentile(fs, 0.95),
+					stats_percentile(fs, 0.99), fs->max_ns / 1e6);
+			for (i = 0; i < STATS_BUCKETS; i++) {
+				if (!fs->hist[i])
+					continue;
+				printf("%s[%.1f, %u]", sep, i * STATS_BUCKET_NS / 1e6,
+						fs->hist[i]);
+				sep = ", ";
+			}
+			printf("]");
+		}
+		printf("}\n");
+	} else {
+		printf("connector %u%s: %u frames in %.2f s, %.1f fps, %u missed vblanks, "
+				"%u dropped\n", output->connector_id, final ? " (total)" : "",
+				fs->frames, secs, fps, fs->missed, fs->dropped);
+		if (fs->count) {
+			printf("  interval ms: min %.2f mean %.2f p50 %.1f p95 %.1f "
+					"p99 %.1f max %.2f\n",
+					fs->min_ns / 1e6, fs->sum_ns / 1e6 / fs->count,
+					stats_percentile(fs, 0.5), stats_percentile(fs, 0.95),
+					stats_percentile(fs, 0.99), fs->max_ns / 1e6);
+			for (i = 0; i < STATS_BUCKETS; i++)
+				if (fs->hist[i])
+					printf("  %5.1f-%5.1f%s: %u\n", i * STATS_BUCKET_NS / 1e6,
+							(i + 1) * STATS_BUCKET_NS / 1e6,
+							i == STATS_BUCKETS - 1 ? "+" : " ", fs->hist[i]);
+		}
+	}
+
+	if (!final)
+		memset(&stats->period, 0, sizeof(stats->period));
+}
+
+/* The size frames for the output are rendered at, the plane scales them
+ * up to the mode.  Kept even, as some scalers want that:
+ */
+void output_render_size(const struct drm *drm, const struct output *output,
+		int *width, int *height)
+{
+	double scale = drm->opts.render_scale;
+
+	if (scale <= 0 || scale >= 1) {
+		*width = output->mode->hdisplay;
+		*height = output->mode->vdisplay;
+		return;
+	}
+
+	*width = ((int)(output->mode->hdisplay * scale) + 1) & ~1;
+	*height = ((int)(output->mode->vdisplay * scale) + 1) & ~1;
+}
+
+/* How long it took from init_drm until the first frame was on screen: */
+void report_first_flip(const struct drm *drm, const struct output *output,
+		uint64_t ns)
+{
+	double ms = ns > drm->start_ns ? (ns - drm->start_ns) / 1e6 : 0;
+
+	if (drm->opts.stats_json)
+		printf("{\"connector\": %u, \"first_flip_ms\": %.3f, \"modeset\": %s}\n",
+				output->connector_id, ms, output->adopted ? "false" : "true");
+	else
+		printf("connector %u: first flip %.1f ms after start%s\n",
+				output->connector_id, ms,
+				output->adopted ? ", without a modeset" : "");
+}
@@ -27,41 +27,234 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
 struct gbm;
 struct egl;
 
+/* Properties used by the atomic commit path.  The ids are looked up by
+ * name once at init, so building a commit is just array indexing:
+ */
+enum plane_prop {
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_IN_FENCE_FD,
+	PLANE_PROP_ZPOS,
+	PLANE_PROP_COUNT
+};
+
+enum crtc_prop {
+	CRTC_PROP_MODE_ID,
+	CRTC_PROP_ACTIVE,
+	CRTC_PROP_VRR_ENABLED,
+	CRTC_PROP_COUNT
+};
+
+enum connector_prop {
+	CONNECTOR_PROP_CRTC_ID,
+	CONNECTOR_PROP_VRR_CAPABLE,
+	CONNECTOR_PROP_COUNT
+};
+
 struct plane {
 	drmModePlane *plane;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[PLANE_PROP_COUNT];
+	/* last committed values, valid if bit set in prop_valid: */
+	uint64_t prop_value[PLANE_PROP_COUNT];
+	uint32_t prop_valid;
+
+	/* what we know about the plane, beyond its formats: */
+	uint64_t type;                /* DRM_PLANE_TYPE_x */
+	int has_zpos;
+	uint64_t zpos_min, zpos_max;  /* equal if zpos is immutable */
+	int can_scale;                /* seen scaling in a test commit */
 };
 
+/* planes usable with our crtc, that we keep track of: */
+#define MAX_PLANES 16
+
 struct crtc {
 	drmModeCrtc *crtc;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[CRTC_PROP_COUNT];
+	/* last committed values, valid if bit set in prop_valid: */
+	uint64_t prop_value[CRTC_PROP_COUNT];
+	uint32_t prop_valid;
 };
 
 struct connector {
 	drmModeConnector *connector;
 	drmModeObjectProperties *props;
 	drmModePropertyRes **props_info;
+	uint32_t prop_id[CONNECTOR_PROP_COUNT];
+	/* last committed values, valid if bit set in prop_valid: */
+	uint64_t prop_value[CONNECTOR_PROP_COUNT];
+	uint32_t prop_valid;
 };
 
-struct drm {
-	int fd;
+#define MAX_FRAMES_IN_FLIGHT 4
 
-	/* only used for atomic: */
-	struct plane *plane;
-	struct crtc *crtc;
-	struct connector *connector;
-	int crtc_index;
-	int kms_in_fence_fd;
-	int kms_out_fence_fd;
+/* presentation options, from the command line: */
+struct drm_options {
+	/* atomic only, frames that may be rendered ahead of the commit: */
+	unsigned int frames_in_flight;
+	/* delay rendering so it finishes just ahead of the next vblank: */
+	int render_late;
+	/* atomic only, scan out video on its own plane if possible: */
+	int video_plane;
+	/* atomic only, drive every connected connector, not just the first: */
+	int all_outputs;
+	/* the modifier given with -m, or DRM_FORMAT_MOD_INVALID to take
+	 * the best each output's primary plane supports:
+	 */
+	uint64_t modifier;
+	/* atomic only, enable adaptive sync where the connector supports it: */
+	int vrr;
+	/* flip as soon as a frame is done, without waiting for vblank: */
+	int async_flip;
+	/* legacy only, render the next frame while the last flip is pending: */
+	int triple_buffer;
+	/* present every interval'th vblank, or as close to fps as that gets: */
+	unsigned int interval;
+	unsigned int fps;
+	/* print the flip statistics as json, one object per line: */
+	int stats_json;
+	/* stop after this many frames and/or seconds, 0 for no limit: */
+	unsigned int max_frames;
+	double duration;
+	/* freeze the animation, and only render when the scene changes: */
+	int static_scene;
+	/* display mode: WxH[@Hz], a policy or a modeline, NULL for the
+	 * connector's preferred one:
+	 */
+	const char *display_mode;
+	/* skip connector probing, and take over the mode already set: */
+	int fast_start;
+	/* atomic only, render at this fraction of the mode size and have
+	 * the plane scale it up:
+	 */
+	double render_scale;
+	/* atomic only, shrink the viewport when frames take too long: */
+	int dynamic_res;
+};
+
+/* Tracks vblank timing from flip events, to predict upcoming vblanks
+ * and how long before one of them a frame needs to be started:
+ */
+struct pacing {
+	uint64_t period_ns;      /* refresh period, refined from flips */
+	unsigned int vblank_seq; /* last vblank seen.. */
+	uint64_t vblank_ns;      /* ..and its timestamp, 0 if none yet */
+	uint64_t render_ns;      /* estimate of how long a frame takes */
+	uint64_t margin_ns;      /* safety margin, grows when we miss */
+};
+
+void pacing_init(struct pacing *pacing, const drmModeModeInfo *mode);
+void pacing_vblank(struct pacing *pacing, unsigned int seq, uint64_t ns);
+void pacing_render_time(struct pacing *pacing, uint64_t ns);
+uint64_t pacing_next_start(const struct pacing *pacing, uint64_t now,
+		unsigned int after_seq, unsigned int *target_seq);
+void pacing_frame_done(struct pacing *pacing, unsigned int target_seq,
+		unsigned int seq);
+uint64_t pacing_vblank_ns(const struct pacing *pacing, unsigned int seq,
+		uint64_t now);
 
+/* Dynamic resolution: the part of the buffer frames are rendered to,
+ * shrunk when rendering gets close to the frame budget and grown back
+ * when there's room, in steps, so only a few sizes come up.  The plane
+ * scales it up to the mode like it does for --render-scale.
+ */
+#define DYNRES_MIN_SCALE 0.5
+#define DYNRES_STEP 0.05
+#define DYNRES_HOLD_FRAMES 30    /* between changes, to see their effect */
+
+struct dynres {
+	double scale;            /* of the buffer size, 1 for all of it */
+	uint64_t render_ns;      /* average, since the last change */
+	unsigned int frames;     /* since the last change */
+};
+
+void dynres_init(struct dynres *dynres);
+int dynres_frame(struct dynres *dynres, uint64_t render_ns, uint64_t budget_ns);
+void dynres_size(const struct dynres *dynres, int width, int height,
+		int *w, int *h);
+
+/* Flip statistics: frame counts, missed vblanks (gaps in the flip
+ * sequence beyond the interval) and a histogram of flip to flip intervals
+ * in half milliseconds, the last bucket collecting everything longer:
+ */
+#define STATS_BUCKET_NS 500000
+#define STATS_BUCKETS 128
+#define STATS_PERIOD_NS 5000000000ull
+
+struct frame_stats {
+	uint64_t start_ns;       /* first flip */
+	unsigned int frames, missed;
+	unsigned int dropped;    /* rendered, but too late to show */
+	unsigned int count;      /* intervals recorded */
+	uint64_t sum_ns, min_ns, max_ns;
+	unsigned int hist[STATS_BUCKETS];
+};
+
+struct stats {
+	struct frame_stats period;   /* since the last report */
+	struct frame_stats total;
+	unsigned int last_seq;
+	uint64_t last_ns;            /* 0 until the first flip */
+};
+
+/* A connector, and the crtc driving it: */
+struct output {
 	drmModeModeInfo *mode;
+	drmModeModeInfo custom_mode;  /* mode points here for a modeline,
+	                               * or the crtc's current mode */
+	int adopted;    /* the crtc already drives the connector in that mode */
+	struct pacing pacing;
+	unsigned int interval;  /* vblanks per frame */
+	struct stats stats;
 	uint32_t crtc_id;
 	uint32_t connector_id;
+	int crtc_index;
+
+	/* only used for atomic: */
+	int vrr;    /* adaptive sync is on, flips happen when frames are ready */
+	uint32_t mode_blob_id;  /* MODE_ID blob for mode, created once */
+	struct dynres dynres;
+	struct plane *planes[MAX_PLANES];
+	unsigned int num_planes;
+	struct crtc *crtc;
+	struct connector *connector;
+};
+
+#define MAX_OUTPUTS 4
+
+struct drm {
+	int fd;
+	uint64_t start_ns;   /* when init_drm started, for time to first flip */
+
+	struct drm_options opts;
+
+	/* the first one is what legacy drives, and what gbm/egl are set
+	 * up for, the rest are only driven by atomic with all_outputs:
+	 */
+	struct output outputs[MAX_OUTPUTS];
+	unsigned int num_outputs;
+
+	/* only used for atomic: */
+	drmModeAtomicReq *req;
 
 	int (*run)(const struct gbm *gbm, const struct egl *egl);
 };
@@ -72,9 +265,25 @@ struct drm_fb {
 };
 
 struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo);
+int drm_fb_init_ring(const struct gbm *gbm);
+int drm_get_modifiers(int fd, const struct output *output, uint32_t format,
+		uint64_t **modifiers);
+int drm_has_format(int fd, const struct output *output, uint32_t format);
+
+int stats_flip(struct stats *stats, unsigned int seq, uint64_t ns,
+		unsigned int interval);
+void stats_drop(struct stats *stats);
+void stats_report(struct stats *stats, const struct output *output,
+		int final, int json);
+void report_first_flip(const struct drm *drm, const struct output *output,
+		uint64_t ns);
+void output_render_size(const struct drm *drm, const struct output *output,
+		int *width, int *height);
+int drm_request_vblank(int fd, const struct output *output, unsigned int seq,
+		void *data);
 
 int init_drm(struct drm *drm, const char *device);
-const struct drm * init_drm_legacy(const char *device);
-const struct drm * init_drm_atomic(const char *device);
+const struct drm * init_drm_legacy(const char *device, const struct drm_options *opts);
+const struct drm * init_drm_atomic(const char *device, const struct drm_options *opts);
 
 #endif /* _DRM_COMMON_H */
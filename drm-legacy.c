@@ -21,115 +21,394 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "drm-common.h"
 
 static struct drm drm;
 
+struct flip {
+	int waiting;
+	unsigned int seq;
+	uint64_t ns;
+};
+
 static void page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	/* suppress 'unused parameter' warnings */
-	(void)fd, (void)frame, (void)sec, (void)usec;
+	(void)fd;
+
+	struct flip *flip = data;
+	flip->waiting = 0;
+	flip->seq = frame;
+	flip->ns = (uint64_t)sec * 1000000000 + (uint64_t)usec * 1000;
+}
+
+static void vblank_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
+{
+	/* suppress 'unused parameter' warnings */
+	(void)fd;
+	(void)frame;
+	(void)sec;
+	(void)usec;
+
+	int *hold = data;
+	*hold = 0;
+}
+
+/* Arm the timer for when it is time to start the next frame: */
+static int arm_render_start(int tfd, unsigned int after_seq,
+		unsigned int *target_seq)
+{
+	uint64_t start = pacing_next_start(&drm.outputs[0].pacing, get_time_ns(),
+			after_seq, target_seq);
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = start / 1000000000,
+			.tv_nsec = start % 1000000000,
+		},
+	};
+
+	return timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+enum legacy_event {
+	EVENT_DRM,
+	EVENT_STDIN,
+	EVENT_TIMER,
+	EVENT_SIGNAL,
+};
+
+static int add_fd(int epfd, int fd, enum legacy_event type)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = type,
+	};
 
-	int *waiting_for_flip = data;
-	*waiting_for_flip = 0;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
+/* Everything the loop waits for, flip events, the render-late timer,
+ * stdin and SIGINT/SIGTERM, comes in through one epoll fd, so each wait
+ * is a single epoll_wait() with nothing to set up again.
+ *
+ * Normally the next frame is rendered once the flip of the previous one
+ * is done.  With triple buffering it is rendered while that flip is
+ * pending, and flipped as soon as it completes.
+ */
 static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 {
-	fd_set fds;
 	drmEventContext evctx = {
 			.version = 2,
 			.page_flip_handler = page_flip_handler,
+			.vblank_handler = vblank_handler,
 	};
-	struct gbm_bo *bo;
+	struct output *output = &drm.outputs[0];
+	struct gbm_bo *bo, *flip_bo = NULL, *queued_bo = NULL;
 	struct drm_fb *fb;
-	uint32_t i = 0;
-	int ret;
+	struct flip flip = { .seq = 0 };
+	unsigned int target_seq = 0, queued_target = 0, flip_target = 0;
+	struct run run;
+	sigset_t mask;
+	int epfd, tfd = -1, sfd = -1;
+	int ready = 1, running = 1, hold = 0;
+	int ret = -1;
 
-	FD_ZERO(&fds);
-	FD_SET(0, &fds);
-	FD_SET(drm.fd, &fds);
+	if (drm_fb_init_ring(gbm)) {
+		printf("failed to create fbs for the buffer ring\n");
+		return -1;
+	}
 
-	eglSwapBuffers(egl->display, egl->surface);
-	bo = gbm_surface_lock_front_buffer(gbm->surface);
-	fb = drm_fb_get_from_bo(bo);
+	bo = swap_buffers(egl, gbm, egl->surface);
+	fb = bo ? drm_fb_get_from_bo(bo) : NULL;
 	if (!fb) {
 		fprintf(stderr, "Failed to get a new framebuffer BO\n");
 		return -1;
 	}
 
+	/* the crtc already shows our mode, just flip to the first frame,
+	 * the old contents stay up until it lands.  If the driver won't
+	 * (a different format, say), fall back to a modeset:
+	 */
+	if (output->adopted) {
+		flip.waiting = 1;
+		if (drmModePageFlip(drm.fd, output->crtc_id, fb->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, &flip)) {
+			printf("can't flip to the current mode, doing a modeset\n");
+			output->adopted = 0;
+		} else {
+			flip_bo = bo;
+			bo = NULL;
+		}
+	}
+
 	/* set mode: */
-	ret = drmModeSetCrtc(drm.fd, drm.crtc_id, fb->fb_id, 0, 0,
-			&drm.connector_id, 1, drm.mode);
-	if (ret) {
-		printf("failed to set mode: %s\n", strerror(errno));
-		return ret;
+	if (!output->adopted) {
+		ret = drmModeSetCrtc(drm.fd, output->crtc_id, fb->fb_id, 0, 0,
+				&output->connector_id, 1, output->mode);
+		if (ret) {
+			printf("failed to set mode: %s\n", strerror(errno));
+			return ret;
+		}
+		report_first_flip(&drm, output, get_time_ns());
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		printf("epoll_create1 failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* signals come in through the signalfd, so we get to clean up: */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+	if (sfd < 0 || add_fd(epfd, sfd, EVENT_SIGNAL) ||
+	    add_fd(epfd, drm.fd, EVENT_DRM)) {
+		printf("failed to set up event loop: %s\n", strerror(errno));
+		goto out;
+	}
+
+	/* stdin may not be pollable (a regular file), then we just go
+	 * without:
+	 */
+	add_fd(epfd, STDIN_FILENO, EVENT_STDIN);
+
+	if (drm.opts.render_late) {
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (tfd < 0 || add_fd(epfd, tfd, EVENT_TIMER)) {
+			printf("failed to set up render timer: %s\n", strerror(errno));
+			goto out;
+		}
 	}
 
-	while (1) {
-		struct gbm_bo *next_bo;
-		int waiting_for_flip = 1;
+	run_start(&run, drm.opts.max_frames, drm.opts.duration);
 
-		egl->draw(i++);
+	while (running) {
+		struct epoll_event events[4];
+		int n, j, render, idle = 0;
 
-		eglSwapBuffers(egl->display, egl->surface);
-		next_bo = gbm_surface_lock_front_buffer(gbm->surface);
-		fb = drm_fb_get_from_bo(next_bo);
-		if (!fb) {
-			fprintf(stderr, "Failed to get a new framebuffer BO\n");
-			return -1;
+		/* the previous flip is done (or we triple buffer), and it's
+		 * time, next frame:
+		 */
+		render = ready && !queued_bo && (!flip_bo || drm.opts.triple_buffer) &&
+				has_free_buffers(gbm);
+
+		/* with a static scene, nothing to do unless something changed,
+		 * the last frame just stays on screen.  Look again in a bit:
+		 */
+		if (render && drm.opts.static_scene && egl->dirty && !egl->dirty(0)) {
+			render = 0;
+			idle = 1;
 		}
 
-		/*
-		 * Here you could also update drm plane layers if you want
-		 * hw composition
+		if (render) {
+			uint64_t start = get_time_ns(), present;
+
+			/* animate for when the frame will be on screen, the
+			 * vblank after the one before it, or as soon as it's
+			 * done with async flips:
+			 */
+			if (!drm.opts.render_late)
+				target_seq = (flip_bo ? flip_target : output->pacing.vblank_seq) +
+						output->interval;
+			if (drm.opts.async_flip)
+				present = start + output->pacing.render_ns;
+			else
+				present = pacing_vblank_ns(&output->pacing, target_seq, start);
+			queued_target = target_seq;
+
+			if (drm.opts.static_scene || present < run.start_ns)
+				present = run.start_ns;
+			bind_buffer(egl, gbm, egl->surface);
+			egl->draw(present - run.start_ns);
+
+			queued_bo = swap_buffers(egl, gbm, egl->surface);
+			fb = queued_bo ? drm_fb_get_from_bo(queued_bo) : NULL;
+			if (!fb) {
+				fprintf(stderr, "Failed to get a new framebuffer BO\n");
+				ret = -1;
+				goto out;
+			}
+
+			/* we don't know when the gpu finishes here, so this is only
+			 * the cpu side, the adaptive margin has to make up the rest:
+			 */
+			pacing_render_time(&output->pacing, get_time_ns() - start);
+
+			if (drm.opts.render_late)
+				ready = 0;
+		}
+
+		/* with an interval, flip once the vblank before the one it
+		 * is meant for has passed, so it lands on that one:
 		 */
+		if (queued_bo && !flip_bo && !hold) {
+			/*
+			 * Here you could also update drm plane layers if you want
+			 * hw composition
+			 */
 
-		ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
-				DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
-		if (ret) {
-			printf("failed to queue page flip: %s\n", strerror(errno));
-			return -1;
+			fb = drm_fb_get_from_bo(queued_bo);
+			flip.waiting = 1;
+			ret = drmModePageFlip(drm.fd, output->crtc_id, fb->fb_id,
+					DRM_MODE_PAGE_FLIP_EVENT |
+					(drm.opts.async_flip ? DRM_MODE_PAGE_FLIP_ASYNC : 0),
+					&flip);
+			if (ret) {
+				printf("failed to queue page flip: %s\n", strerror(errno));
+				ret = -1;
+				goto out;
+			}
+			flip_bo = queued_bo;
+			flip_target = queued_target;
+			queued_bo = NULL;
 		}
 
-		while (waiting_for_flip) {
-			ret = select(drm.fd + 1, &fds, NULL, NULL, NULL);
-			if (ret < 0) {
-				printf("select err: %s\n", strerror(errno));
-				return ret;
-			} else if (ret == 0) {
-				printf("select timeout!\n");
-				return -1;
-			} else if (FD_ISSET(0, &fds)) {
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events),
+				idle ? (int)(output->pacing.period_ns / 1000000) + 1 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("epoll_wait err: %s\n", strerror(errno));
+			ret = -1;
+			goto out;
+		}
+
+		/* idle, no flips to end the run on: */
+		if (idle && run_expired(&run))
+			break;
+
+		for (j = 0; j < n; j++) {
+			struct signalfd_siginfo info;
+			uint64_t expirations;
+
+			switch (events[j].data.u32) {
+			case EVENT_DRM:
+				drmHandleEvent(drm.fd, &evctx);
+				if (!flip_bo || flip.waiting)
+					break;
+
+				/* with async flips, vblanks don't pace the frames: */
+				if (stats_flip(&output->stats, flip.seq, flip.ns,
+						drm.opts.async_flip ? 0 : output->interval))
+					stats_report(&output->stats, output, 0,
+							drm.opts.stats_json);
+				if (run_frame(&run))
+					running = 0;
+
+				/* the flip that replaced the boot splash: */
+				if (!bo)
+					report_first_flip(&drm, output, flip.ns);
+
+				if (drm.opts.render_late)
+					pacing_frame_done(&output->pacing, flip_target, flip.seq);
+				pacing_vblank(&output->pacing, flip.seq, flip.ns);
+
+				/* release last buffer to render on again: */
+				if (bo)
+					release_buffer(gbm, bo);
+				bo = flip_bo;
+				flip_bo = NULL;
+
+				if (output->interval > 1) {
+					hold = 1;
+					if (drm_request_vblank(drm.fd, output,
+							flip.seq + output->interval - 1, &hold)) {
+						printf("failed to request vblank event: %s\n",
+								strerror(errno));
+						ret = -1;
+						goto out;
+					}
+				}
+
+				/* aim for the interval'th vblank after the one just
+				 * flipped:
+				 */
+				if (drm.opts.render_late) {
+					if (arm_render_start(tfd,
+							flip.seq + output->interval - 1,
+							&target_seq)) {
+						printf("failed to arm render timer: %s\n",
+								strerror(errno));
+						ret = -1;
+						goto out;
+					}
+				} else {
+					ready = 1;
+				}
+				break;
+			case EVENT_TIMER:
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					ready = 1;
+				break;
+			case EVENT_STDIN:
 				printf("user interrupted!\n");
+				running = 0;
+				break;
+			case EVENT_SIGNAL:
+				if (read(sfd, &info, sizeof(info)) == sizeof(info))
+					printf("got signal %u, exiting\n", info.ssi_signo);
+				running = 0;
 				break;
 			}
-			drmHandleEvent(drm.fd, &evctx);
 		}
-
-		/* release last buffer to render on again: */
-		gbm_surface_release_buffer(gbm->surface, bo);
-		bo = next_bo;
 	}
 
-	return 0;
+	stats_report(&output->stats, output, 1, drm.opts.stats_json);
+	run_report(&run, drm.opts.stats_json);
+
+	ret = 0;
+
+out:
+	if (tfd >= 0)
+		close(tfd);
+	if (sfd >= 0)
+		close(sfd);
+	close(epfd);
+
+	return ret;
 }
 
-const struct drm * init_drm_legacy(const char *device)
+const struct drm * init_drm_legacy(const char *device, const struct drm_options *opts)
 {
 	int ret;
 
+	drm.opts = *opts;
+
 	ret = init_drm(&drm, device);
 	if (ret)
 		return NULL;
 
+	if (drm.opts.async_flip) {
+		uint64_t cap = 0;
+
+		if (drmGetCap(drm.fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap) || !cap) {
+			printf("no async page flips, flipping on vblank\n");
+			drm.opts.async_flip = 0;
+		} else {
+			/* frames go out as soon as they're done: */
+			drm.opts.render_late = 0;
+			drm.outputs[0].interval = 1;
+		}
+	}
+
 	drm.run = legacy_run;
 
 	return &drm;
@@ -116,11 +116,10 @@ int dump_run(const struct gbm *gbm, const struct egl *egl)
 		GLubyte *result;
 		struct gbm_bo *bo;
 
-		egl->draw(i << 4);
+		bind_buffer(egl, gbm, egl->surface);
+		egl->draw(ANIMATION_NS(i << 4));
 
-		eglSwapBuffers(egl->display, egl->surface);
-
-		bo = gbm_surface_lock_front_buffer(gbm->surface);
+		bo = swap_buffers(egl, gbm, egl->surface);
 		assert(bo);
 
 		result = gbm_bo_map(bo, 0, 0, DUMP_TARGET_WIDTH, DUMP_TARGET_HEIGHT,
@@ -132,7 +131,7 @@ int dump_run(const struct gbm *gbm, const struct egl *egl)
 		name[4]++;
 
 		gbm_bo_unmap(bo, map_data);
-		gbm_surface_release_buffer(gbm->surface, bo);
+		release_buffer(gbm, bo);
 	}
 
 	return 0;
@@ -23,6 +23,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,8 @@
 
 #include "common.h"
 
+#include <xf86drm.h>
+#include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
 #include <gst/gst.h>
@@ -66,6 +69,19 @@ struct decoder {
 
 	EGLImage            last_frame;
 	GstSample          *last_samp;
+
+	/* pulled by video_frame_pending(), for the next video_frame(): */
+	GstSample          *next_samp;
+
+	/* dmabuf of the last frame, to create an fb from if asked for: */
+	int                 last_fd;
+	uint32_t            last_offsets[MAX_NUM_PLANES];
+	uint32_t            last_strides[MAX_NUM_PLANES];
+	uint32_t            last_fb;
+	int                 fb_failed;
+
+	uint32_t            fbs[VIDEO_FB_HISTORY];
+	unsigned            fb_idx;
 };
 
 static GstPadProbeReturn
@@ -268,6 +284,7 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	dec->loop = g_main_loop_new(NULL, FALSE);
 	dec->gbm = gbm;
 	dec->egl = egl;
+	dec->last_fd = -1;
 
 	/* Setup pipeline: */
 	static const char *pipeline =
@@ -322,7 +339,7 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 }
 
 static void
-set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp)
+set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp, int fd)
 {
 	if (dec->last_frame)
 		dec->egl->eglDestroyImageKHR(dec->egl->display, dec->last_frame);
@@ -330,6 +347,10 @@ set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp)
 	if (dec->last_samp)
 		gst_sample_unref(dec->last_samp);
 	dec->last_samp = samp;
+	if (dec->last_fd >= 0)
+		close(dec->last_fd);
+	dec->last_fd = fd;
+	dec->last_fb = 0;
 }
 
 // TODO this could probably be a helper re-used by cube-tex:
@@ -358,8 +379,9 @@ buf_to_fd(const struct gbm *gbm, int size, void *ptr)
 	return fd;
 }
 
+/* Also hands back the dmabuf fd, in case the frame gets scanned out: */
 static EGLImage
-buffer_to_image(struct decoder *dec, GstBuffer *buf)
+buffer_to_image(struct decoder *dec, GstBuffer *buf, int *fd)
 {
 	struct { int fd, offset, stride; } planes[MAX_NUM_PLANES];
 	GstVideoMeta *meta = gst_buffer_get_video_meta(buf);
@@ -388,6 +410,8 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		EGL_DMA_BUF_PLANE2_PITCH_EXT,
 	};
 
+	*fd = -1;
+
 	/* Query gst_is_dmabuf_memory() here, since the gstmemory
 	 * block might get merged below by gst_buffer_map(), meaning
 	 * that the mem pointer would become invalid */
@@ -489,9 +513,11 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 				EGL_LINUX_DMA_BUF_EXT, NULL, attr);
 	}
 
-	/* Cleanup */
-	for (unsigned i = 0; i < nmems; i++)
-		close(planes[i].fd);
+	for (i = 0; i < nplanes; i++) {
+		dec->last_offsets[i] = planes[i].offset;
+		dec->last_strides[i] = planes[i].stride;
+	}
+	*fd = dmabuf_fd;
 
 	return image;
 }
@@ -502,8 +528,14 @@ video_frame(struct decoder *dec)
 	GstSample *samp;
 	GstBuffer *buf;
 	EGLImage   frame = NULL;
+	int        fd;
 
-	samp = gst_app_sink_pull_sample(GST_APP_SINK(dec->sink));
+	if (dec->next_samp) {
+		samp = dec->next_samp;
+		dec->next_samp = NULL;
+	} else {
+		samp = gst_app_sink_pull_sample(GST_APP_SINK(dec->sink));
+	}
 	if (!samp) {
 		GST_DEBUG("got no appsink sample");
 		return NULL;
@@ -512,21 +544,106 @@ video_frame(struct decoder *dec)
 	buf = gst_sample_get_buffer(samp);
 
 	// TODO inline buffer_to_image??
-	frame = buffer_to_image(dec, buf);
+	frame = buffer_to_image(dec, buf, &fd);
 
 	// TODO in the zero-copy dmabuf case it would be nice to associate
 	// the eglimg w/ the buffer to avoid recreating it every frame..
 
-	set_last_frame(dec, frame, samp);
+	set_last_frame(dec, frame, samp, fd);
 
 	dec->frame++;
 
 	return frame;
 }
 
+/* Whether video_frame() has something new, without blocking for it: a
+ * frame, or the end of the stream.
+ */
+int
+video_frame_pending(struct decoder *dec)
+{
+	if (!dec->next_samp)
+		dec->next_samp = gst_app_sink_try_pull_sample(
+				GST_APP_SINK(dec->sink), 0);
+
+	return dec->next_samp || gst_app_sink_is_eos(GST_APP_SINK(dec->sink));
+}
+
+static uint32_t
+add_fb(struct decoder *dec)
+{
+	int fd = gbm_device_get_fd(dec->gbm->dev);
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	struct drm_gem_close gem_close = {0};
+	guint nplanes = GST_VIDEO_INFO_N_PLANES(&(dec->info));
+	uint32_t fb_id = 0;
+	guint i;
+	int ret;
+
+	ret = drmPrimeFDToHandle(fd, dec->last_fd, &gem_close.handle);
+	if (ret) {
+		printf("failed to import video dmabuf: %s\n", strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < nplanes; i++) {
+		handles[i] = gem_close.handle;
+		pitches[i] = dec->last_strides[i];
+		offsets[i] = dec->last_offsets[i];
+	}
+
+	ret = drmModeAddFB2(fd, GST_VIDEO_INFO_WIDTH(&(dec->info)),
+			GST_VIDEO_INFO_HEIGHT(&(dec->info)), dec->format,
+			handles, pitches, offsets, &fb_id, 0);
+	if (ret) {
+		printf("failed to create fb for video frame: %s\n", strerror(errno));
+		fb_id = 0;
+	}
+
+	/* the fb holds its own reference to the buffer: */
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	return fb_id;
+}
+
+uint32_t
+video_frame_fb(struct decoder *dec, uint32_t *format,
+		uint32_t *width, uint32_t *height)
+{
+	int fd = gbm_device_get_fd(dec->gbm->dev);
+
+	if (dec->last_fb || dec->last_fd < 0 || dec->fb_failed)
+		goto out;
+
+	dec->last_fb = add_fb(dec);
+	if (!dec->last_fb) {
+		/* not going to get any better for the next frames: */
+		dec->fb_failed = 1;
+		goto out;
+	}
+
+	dec->fb_idx = (dec->fb_idx + 1) % VIDEO_FB_HISTORY;
+	if (dec->fbs[dec->fb_idx])
+		drmModeRmFB(fd, dec->fbs[dec->fb_idx]);
+	dec->fbs[dec->fb_idx] = dec->last_fb;
+
+out:
+	*format = dec->format;
+	*width = GST_VIDEO_INFO_WIDTH(&(dec->info));
+	*height = GST_VIDEO_INFO_HEIGHT(&(dec->info));
+	return dec->last_fb;
+}
+
 void video_deinit(struct decoder *dec)
 {
-	set_last_frame(dec, NULL, NULL);
+	unsigned i;
+
+	set_last_frame(dec, NULL, NULL, -1);
+	if (dec->next_samp)
+		gst_sample_unref(dec->next_samp);
+	for (i = 0; i < VIDEO_FB_HISTORY; i++)
+		if (dec->fbs[i])
+			drmModeRmFB(gbm_device_get_fd(dec->gbm->dev), dec->fbs[i]);
 	gst_element_set_state(dec->pipeline, GST_STATE_NULL);
 	gst_object_unref(dec->sink);
 	gst_object_unref(dec->pipeline);
@@ -37,39 +37,151 @@
 GST_DEBUG_CATEGORY(kmscube_debug);
 #endif
 
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
-
 static const struct egl *egl;
 static const struct gbm *gbm;
 static const struct drm *drm;
 
-static const char *shortopts = "AD:dM:m:V:";
+static const char *shortopts = "AaBb:c:D:dF:f:I:jLM:m:n:OPRr:SsTt:V:v:y";
 
 static const struct option longopts[] = {
 	{"atomic", no_argument,       0, 'A'},
+	{"async",  no_argument,       0, 'a'},
+	{"benchmark", no_argument,    0, 'B'},
+	{"buffers", required_argument, 0, 'b'},
+	{"format", required_argument, 0, 'c'},
 	{"device", required_argument, 0, 'D'},
 	{"dump", no_argument, 0, 'd'},
+	{"frames-in-flight", required_argument, 0, 'F'},
+	{"fps",    required_argument, 0, 'f'},
+	{"interval", required_argument, 0, 'I'},
+	{"json",   no_argument,       0, 'j'},
+	{"render-late", no_argument, 0, 'L'},
 	{"mode",   required_argument, 0, 'M'},
 	{"modifier", required_argument, 0, 'm'},
+	{"frames", required_argument, 0, 'n'},
+	{"all-outputs", no_argument,  0, 'O'},
+	{"video-plane", no_argument,  0, 'P'},
+	{"vrr",    no_argument,       0, 'R'},
+	{"render-scale", required_argument, 0, 'r'},
+	{"static", no_argument,       0, 'S'},
+	{"fast-start", no_argument,   0, 's'},
+	{"triple-buffer", no_argument, 0, 'T'},
+	{"duration", required_argument, 0, 't'},
 	{"video",  required_argument, 0, 'V'},
+	{"display-mode", required_argument, 0, 'v'},
+	{"dynamic-res", no_argument,  0, 'y'},
 	{0, 0, 0, 0}
 };
 
+#define MAX_FORMATS 8
+
+static const struct {
+	const char *name;
+	uint32_t format, alpha;    /* alpha is 0 if there's no variant */
+} format_names[] = {
+	{ "xrgb8888",    GBM_FORMAT_XRGB8888,    GBM_FORMAT_ARGB8888 },
+	{ "xbgr8888",    GBM_FORMAT_XBGR8888,    GBM_FORMAT_ABGR8888 },
+	{ "rgb565",      GBM_FORMAT_RGB565,      0 },
+	{ "xrgb2101010", GBM_FORMAT_XRGB2101010, GBM_FORMAT_ARGB2101010 },
+	{ "xbgr2101010", GBM_FORMAT_XBGR2101010, GBM_FORMAT_ABGR2101010 },
+};
+
+/* A comma separated list of format names, most wanted first: */
+static int parse_formats(const char *list, uint32_t *formats)
+{
+	int count = 0;
+	unsigned int i;
+
+	while (*list) {
+		size_t len = strcspn(list, ",");
+
+		for (i = 0; i < ARRAY_SIZE(format_names); i++)
+			if (strlen(format_names[i].name) == len &&
+			    strncmp(list, format_names[i].name, len) == 0)
+				break;
+
+		if (i == ARRAY_SIZE(format_names) || count == MAX_FORMATS) {
+			printf("invalid format list: %s\n", list);
+			return -1;
+		}
+		formats[count++] = format_names[i].format;
+
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+
+	return count ? count : -1;
+}
+
+static uint32_t format_with_alpha(uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(format_names); i++)
+		if (format_names[i].format == format)
+			return format_names[i].alpha;
+
+	return 0;
+}
+
 static void usage(const char *name)
 {
-	printf("Usage: %s [-ADMmV]\n"
+	printf("Usage: %s [-AaBbcDFfIjLMmnOPRrSsTtVvy]\n"
 			"\n"
 			"options:\n"
 			"    -A, --atomic             use atomic modesetting and fencing\n"
+			"    -a, --async              flip as soon as each frame is done, without\n"
+			"                             waiting for vblank (tears)\n"
+			"    -B, --benchmark          render as fast as possible without\n"
+			"                             displaying anything, needs -n or -t\n"
+			"    -b, --buffers=N          render to a ring of N (2-8) scanout buffers\n"
+			"                             of our own instead of a gbm surface\n"
+			"    -c, --format=FMT[,FMT]   scanout format, the first the display takes\n"
+			"                             of xrgb8888 (default), xbgr8888, rgb565,\n"
+			"                             xrgb2101010, xbgr2101010\n"
 			"    -D, --device=DEVICE      use the given device\n"
 			"    -d, --dump               dump frames to png files\n"
+			"    -F, --frames-in-flight=N frames to render ahead of the pending\n"
+			"                             atomic commit (default 1)\n"
+			"    -f, --fps=FPS            present every Nth vblank, as close to FPS\n"
+			"                             as the refresh rate allows\n"
+			"    -I, --interval=N         present every Nth vblank (default 1)\n"
+			"    -j, --json               print the flip statistics as json\n"
+			"    -L, --render-late        start each frame as late as possible before\n"
+			"                             the vblank it is meant for\n"
 			"    -M, --mode=MODE          specify mode, one of:\n"
 			"        smooth    -  smooth shaded cube (default)\n"
 			"        rgba      -  rgba textured cube\n"
 			"        nv12-2img -  yuv textured (color conversion in shader)\n"
 			"        nv12-1img -  yuv textured (single nv12 texture)\n"
-			"    -m, --modifier=MODIFIER  hardcode the selected modifier\n"
-			"    -V, --video=FILE         video textured cube\n",
+			"    -m, --modifier=MODIFIER  hardcode the selected modifier, or \"linear\"\n"
+			"                             (default: best the primary plane takes)\n"
+			"    -n, --frames=N           exit after N frames\n"
+			"    -O, --all-outputs        with -A, drive every connected output\n"
+			"                             (not with -V)\n"
+			"    -P, --video-plane        with -A and -V, scan out the video on a\n"
+			"                             plane under the cube if possible\n"
+			"    -R, --vrr                with -A, use adaptive sync where supported,\n"
+			"                             flipping as soon as each frame is ready\n"
+			"    -r, --render-scale=S     with -A, render at S (0.1-1) times the mode\n"
+			"                             size, and have the display scale it up\n"
+			"    -S, --static             stop the cube, and only render and flip\n"
+			"                             when the scene changes (video frames)\n"
+			"    -s, --fast-start         don't probe connectors, and keep the mode\n"
+			"                             already set if there is one (no modeset)\n"
+			"    -T, --triple-buffer      without -A, render the next frame while\n"
+			"                             the previous flip is pending\n"
+			"    -t, --duration=SECONDS   exit after SECONDS\n"
+			"    -V, --video=FILE         video textured cube\n"
+			"    -v, --display-mode=MODE  display mode (default: preferred), one of:\n"
+			"        WxH[@Hz]               that size, closest refresh or highest\n"
+			"        largest                largest, at the highest refresh\n"
+			"        highest-refresh        highest refresh, at the largest size\n"
+			"        lowest-res-max-refresh smallest with the highest refresh\n"
+			"        modeline:MODELINE      custom X11 style modeline\n"
+			"    -y, --dynamic-res        with -A, render smaller when frames take too\n"
+			"                             long, the display scales them up\n",
 			name);
 }
 
@@ -79,9 +191,20 @@ int main(int argc, char *argv[])
 	const char *video = NULL;
 	enum mode mode = SMOOTH;
 	uint64_t modifier = DRM_FORMAT_MOD_INVALID;
-	int atomic = 0, dump = 0;
+	uint64_t *plane_modifiers = NULL;
+	const uint64_t *modifiers = NULL;
+	int count = 0;
+	struct drm_options opts = {
+		.frames_in_flight = 1,
+		.render_scale = 1.0,
+	};
+	int atomic = 0, dump = 0, benchmark = 0;
+	unsigned int buffers = 0;
+	uint32_t formats[MAX_FORMATS] = { GBM_FORMAT_XRGB8888 };
+	int num_formats = 1;
 	int opt;
-	int fd, width, height;
+	int fd, width, height, i;
+	uint32_t format = 0;
 
 #ifdef HAVE_GST
 	gst_init(&argc, &argv);
@@ -93,12 +216,43 @@ int main(int argc, char *argv[])
 		case 'A':
 			atomic = 1;
 			break;
+		case 'a':
+			opts.async_flip = 1;
+			break;
+		case 'B':
+			benchmark = 1;
+			break;
+		case 'b':
+			buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			num_formats = parse_formats(optarg, formats);
+			if (num_formats < 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
 		case 'D':
 			device = optarg;
 			break;
 		case 'd':
 			dump = 1;
 			break;
+		case 'F':
+			opts.frames_in_flight = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			opts.fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			opts.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			opts.stats_json = 1;
+			break;
+		case 'L':
+			opts.render_late = 1;
+			break;
 		case 'M':
 			if (strcmp(optarg, "smooth") == 0) {
 				mode = SMOOTH;
@@ -115,18 +269,77 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 'm':
-			modifier = strtoull(optarg, NULL, 0);
+			if (strcmp(optarg, "linear") == 0)
+				modifier = DRM_FORMAT_MOD_LINEAR;
+			else
+				modifier = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.max_frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			opts.all_outputs = 1;
+			break;
+		case 'P':
+			opts.video_plane = 1;
+			break;
+		case 'R':
+			opts.vrr = 1;
+			break;
+		case 'r':
+			opts.render_scale = strtod(optarg, NULL);
+			break;
+		case 'S':
+			opts.static_scene = 1;
+			break;
+		case 's':
+			opts.fast_start = 1;
+			break;
+		case 'T':
+			opts.triple_buffer = 1;
+			break;
+		case 't':
+			opts.duration = strtod(optarg, NULL);
 			break;
 		case 'V':
 			mode = VIDEO;
 			video = optarg;
 			break;
+		case 'v':
+			opts.display_mode = optarg;
+			break;
+		case 'y':
+			opts.dynamic_res = 1;
+			break;
 		default:
 			usage(argv[0]);
 			return -1;
 		}
 	}
 
+	/* the video plane only works with atomic, and needs an alpha
+	 * channel to see through the cube's background:
+	 */
+	if (mode != VIDEO || !atomic || dump)
+		opts.video_plane = 0;
+
+	/* every output would pull its own frames from the one decoder, each
+	 * seeing only some of them:
+	 */
+	if (mode == VIDEO && opts.all_outputs && atomic) {
+		printf("can't play a video on all outputs\n");
+		return -1;
+	}
+
+	opts.modifier = modifier;
+
+	if (!atomic) {
+		opts.all_outputs = 0;
+		opts.vrr = 0;
+		opts.render_scale = 1.0;
+		opts.dynamic_res = 0;
+	}
+
 	if (dump) {
 		width = DUMP_TARGET_WIDTH;
 		height = DUMP_TARGET_HEIGHT;
@@ -138,19 +351,57 @@ int main(int argc, char *argv[])
 	}
 	else {
 		if (atomic)
-			drm = init_drm_atomic(device);
+			drm = init_drm_atomic(device, &opts);
 		else
-			drm = init_drm_legacy(device);
+			drm = init_drm_legacy(device, &opts);
 		if (!drm) {
 			printf("failed to initialize %s DRM\n", atomic ? "atomic" : "legacy");
 			return -1;
 		}
 		fd = drm->fd;
-		width = drm->mode->hdisplay;
-		height = drm->mode->vdisplay;
+		output_render_size(drm, &drm->outputs[0], &width, &height);
+	}
+
+	/* the first format on the list the primary plane takes, with alpha
+	 * for the video plane if there is such a variant:
+	 */
+	for (i = 0; i < num_formats && !format; i++) {
+		uint32_t f = formats[i];
+
+		if (opts.video_plane)
+			f = format_with_alpha(f);
+		if (f && (!drm || drm_has_format(drm->fd, &drm->outputs[0], f)))
+			format = f;
+	}
+	if (!format) {
+		printf("the display takes none of the formats asked for%s\n",
+				opts.video_plane ? " (with alpha, for the video plane)" : "");
+		return -1;
+	}
+	/* the png writer takes 8 bits per channel, 4 bytes per pixel: */
+	if (dump && format != GBM_FORMAT_XRGB8888 &&
+	    format != GBM_FORMAT_XBGR8888) {
+		printf("can't dump %.4s, only xrgb8888 and xbgr8888\n",
+				(char *)&format);
+		return -1;
 	}
+	printf("using format %.4s\n", (char *)&format);
 
-	gbm = init_gbm(fd, width, height, modifier);
+	if (modifier != DRM_FORMAT_MOD_INVALID) {
+		modifiers = &modifier;
+		count = 1;
+	}
+#ifdef HAVE_GBM_MODIFIERS
+	else if (drm) {
+		/* let the driver pick the best of what the display takes: */
+		count = drm_get_modifiers(drm->fd, &drm->outputs[0], format,
+				&plane_modifiers);
+		modifiers = plane_modifiers;
+	}
+#endif
+
+	gbm = init_gbm(fd, width, height, format, modifiers, count, buffers);
+	free(plane_modifiers);
 	if (!gbm) {
 		printf("failed to initialize GBM\n");
 		return -1;
@@ -172,8 +423,14 @@ int main(int argc, char *argv[])
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	if (dump)
+	if (dump) {
 		return dump_run(gbm, egl);
-	else
+	} else if (benchmark) {
+		struct run run;
+
+		run_start(&run, opts.max_frames, opts.duration);
+		return benchmark_run(gbm, egl, &run, opts.stats_json);
+	} else {
 		return drm->run(gbm, egl);
+	}
 }